@@ -0,0 +1,171 @@
+//------------------------------------------------------------------------------
+//		cache.cpp
+//------------------------------------------------------------------------------
+
+#include "mosquito_nr.h"
+#include <string.h>
+
+// the output of each frame is kept in a slot of the cache file, so that a later run of the same script
+// (e.g. the second pass of an encode) reads it instead of filtering again. slot 0 holds the key of the
+// clip and the settings, the others the processed planes of a frame after the hash of its source.
+// the file is sparse, the slots of frames never filtered take no disk space
+
+const uint64_t CACHE_VALID = 0x4548434143524e4dULL; // "MNRCACHE", the slot holds a frame
+const int CACHE_VERSION = 1; // to be bumped whenever the output of the filter or the layout of the file changes
+
+struct CacheKey
+{
+  char magic[8];
+  int version;
+  int width, height, pixel_type, num_frames;
+  int strength, restore, radius, flat;
+  int exact, chroma, interlaced, masked, iterations;
+};
+
+struct CacheSlot
+{
+  uint64_t hash; // of the source (and mask) samples the output was filtered from
+  uint64_t valid; // CACHE_VALID, written after the samples
+};
+
+// FNV-1a on 8 bytes at a time, with a shift so that the upper bits of a word reach the lower bits of the hash
+static uint64_t HashRows(uint64_t h, const BYTE* p, int pitch, int row_size, int height)
+{
+  for (int y = 0; y < height; ++y, p += pitch) {
+    int x = 0;
+    for (; x + 8 <= row_size; x += 8) {
+      uint64_t w;
+      memcpy(&w, p + x, 8);
+      h = (h ^ w) * 0x100000001b3ULL;
+      h ^= h >> 29;
+    }
+    for (; x < row_size; ++x)
+      h = (h ^ p[x]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// false if the file cannot be opened, e.g. a wrong path
+bool MosquitoNR::OpenCache(const char* path)
+{
+  CacheKey key;
+  memset(&key, 0, sizeof(key));
+  memcpy(key.magic, "MNRCACHE", 8);
+  key.version = CACHE_VERSION;
+  key.width = width, key.height = height, key.pixel_type = vi.pixel_type, key.num_frames = vi.num_frames;
+  key.strength = strength, key.restore = restore, key.radius = radius, key.flat = flat;
+  key.exact = exact, key.chroma = chroma, key.interlaced = interlaced, key.masked = mask ? 1 : 0, key.iterations = iterations;
+
+  // a slot starts on the allocation granularity, so that it is mapped on its own
+  size_t bytes = sizeof(CacheSlot);
+  for (int p = 0; p < (chroma || vi.IsRGB() ? 3 : 1); ++p) {
+    const int sub_x = chroma && p ? vi.GetPlaneWidthSubsampling(PLANAR_U) : 0, sub_y = chroma && p ? vi.GetPlaneHeightSubsampling(PLANAR_U) : 0;
+    bytes += (size_t)(width >> sub_x) * (vi.IsYUY2() ? 2 : vi.ComponentSize()) * (height >> sub_y);
+  }
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  cache_slot = (bytes + si.dwAllocationGranularity - 1) / si.dwAllocationGranularity * si.dwAllocationGranularity;
+
+  cache_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (cache_file == INVALID_HANDLE_VALUE) {
+    cache_file = NULL;
+    return false;
+  }
+
+  // a new file, or one written for another clip or other settings, is started over.
+  // the file is shared with other instances of the same script (a preview and an encoder, or those of Prefetch),
+  // which write the same output. one that cannot start it over, as another instance with other settings
+  // has it mapped, or cannot map it, runs without the cache
+  CacheKey old;
+  DWORD done = 0;
+  if (!ReadFile(cache_file, &old, sizeof(old), &done, NULL) || done != sizeof(old) || memcmp(&old, &key, sizeof(key))) {
+    SetFilePointer(cache_file, 0, NULL, FILE_BEGIN);
+    if (!SetEndOfFile(cache_file)) {
+      CloseCache();
+      return true;
+    }
+    DeviceIoControl(cache_file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &done, NULL); // not supported by FAT, the file is just larger
+    if (!WriteFile(cache_file, &key, sizeof(key), &done, NULL) || done != sizeof(key)) {
+      CloseCache();
+      return true;
+    }
+  }
+
+  const uint64_t size = (uint64_t)(vi.num_frames + 1) * cache_slot;
+  cache_map = CreateFileMappingA(cache_file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+  if (!cache_map) CloseCache();
+  return true;
+}
+
+void MosquitoNR::CloseCache()
+{
+  if (cache_map) CloseHandle(cache_map);
+  if (cache_file) CloseHandle(cache_file);
+  cache_map = cache_file = NULL;
+}
+
+// hash of the samples of the current frame the output depends on
+uint64_t MosquitoNR::SourceHash() const
+{
+  const int* planes = vi.IsRGB() ? rgb_planes : yuv_planes;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (int p = 0; p < (chroma || vi.IsRGB() ? 3 : 1); ++p)
+    h = HashRows(h, src->GetReadPtr(planes[p]), src->GetPitch(planes[p]), src->GetRowSize(planes[p]), src->GetHeight(planes[p]));
+  if (mask) h = HashRows(h, mfr->GetReadPtr(), mfr->GetPitch(), mfr->GetRowSize(), mfr->GetHeight());
+  return h;
+}
+
+// copies the processed planes of frame n from the cache file, if they were filtered from the same source
+bool MosquitoNR::ReadCache(int n, uint64_t hash)
+{
+  const uint64_t offset = (uint64_t)(n + 1) * cache_slot;
+  const BYTE* view = (const BYTE*)MapViewOfFile(cache_map, FILE_MAP_READ, (DWORD)(offset >> 32), (DWORD)offset, cache_slot);
+  if (!view) return false;
+
+  // another instance may write the slot meanwhile, the samples count only if it was valid before and after they were read
+  volatile const CacheSlot* slot = (volatile const CacheSlot*)view;
+  bool hit = slot->valid == CACHE_VALID && slot->hash == hash;
+  if (hit) {
+    MemoryBarrier();
+    const int* planes = vi.IsRGB() ? rgb_planes : yuv_planes;
+    const BYTE* srcp = view + sizeof(CacheSlot);
+    for (int p = 0; p < (chroma || vi.IsRGB() ? 3 : 1); ++p) {
+      const int row_size = dst->GetRowSize(planes[p]), dst_pitch = dst->GetPitch(planes[p]);
+      BYTE* dstp = dst->GetWritePtr(planes[p]);
+      for (int y = 0; y < dst->GetHeight(planes[p]); ++y, srcp += row_size)
+        memcpy(dstp + y * dst_pitch, srcp, row_size);
+    }
+    MemoryBarrier();
+    hit = slot->valid == CACHE_VALID && slot->hash == hash;
+  }
+
+  UnmapViewOfFile(view);
+  return hit;
+}
+
+// stores the processed planes of frame n in the cache file
+void MosquitoNR::WriteCache(int n, uint64_t hash)
+{
+  const uint64_t offset = (uint64_t)(n + 1) * cache_slot;
+  BYTE* view = (BYTE*)MapViewOfFile(cache_map, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)offset, cache_slot);
+  if (!view) return; // e.g. the disk is full, the frame is filtered again next time
+
+  // the slot is invalid while its samples are written, so that other instances never read them half written
+  volatile CacheSlot* slot = (volatile CacheSlot*)view;
+  slot->valid = 0;
+  MemoryBarrier();
+
+  const int* planes = vi.IsRGB() ? rgb_planes : yuv_planes;
+  BYTE* dstp = view + sizeof(CacheSlot);
+  for (int p = 0; p < (chroma || vi.IsRGB() ? 3 : 1); ++p) {
+    const int row_size = dst->GetRowSize(planes[p]), src_pitch = dst->GetPitch(planes[p]);
+    const BYTE* srcp = dst->GetReadPtr(planes[p]);
+    for (int y = 0; y < dst->GetHeight(planes[p]); ++y, dstp += row_size)
+      memcpy(dstp, srcp + y * src_pitch, row_size);
+  }
+
+  slot->hash = hash;
+  MemoryBarrier();
+  slot->valid = CACHE_VALID;
+  UnmapViewOfFile(view);
+}
@@ -21,11 +21,64 @@
 
 #include "mosquito_nr.h"
 #include <emmintrin.h>
+#include <string.h>
+
+// pitch of the line buffers: the width rounded up to 8 plus 16 columns for the reflected edges,
+// rounded up to whole cache lines so that every row starts on one
+static int PlanPitch(int width)
+{
+  return (((width + 7) & ~7) + 16 + 31) & ~31; // 32 shorts = 64 bytes
+}
+
+// planes wider than strip_width are processed in vertical strips
+static int Strips(int width, int strip_width) { return (width + strip_width - 1) / strip_width; }
+
+// columns of the widest strip of a plane including its halo
+static int StripColumns(int width, int strip_width)
+{
+  const int strips = Strips(width, strip_width);
+  return min(width, (width + strips - 1) / strips + 15 + STRIP_HALO * 2);
+}
+
+// columns of the widest strip of any part of a plane, a narrower part may be divided into fewer strips
+static int MaxStripColumns(int width, int strip_width)
+{
+  return min(width, max(StripColumns(width, strip_width), strip_width + 15 + STRIP_HALO * 2));
+}
+
+// samples of a row from its start (step 1) or end (step -1) that are equal to v
+template<typename T>
+static int Run(const BYTE* row, int n, int stride, int step, const BYTE* v)
+{
+  const T* p = reinterpret_cast<const T*>(row) + (step > 0 ? 0 : (n - 1) * stride);
+  const T value = *reinterpret_cast<const T*>(v);
+  int x = 0;
+  while (x < n && p[x * step * stride] == value) x++;
+  return x;
+}
+
+// float samples are compared by their bits, YUY2 luma is every other byte
+static int RowRun(const BYTE* row, int bits, bool yuy2, int n, int step, const BYTE* v)
+{
+  if (bits == 8) return Run<BYTE>(row, n, yuy2 ? 2 : 1, step, v);
+  if (bits == 32) return Run<uint32_t>(row, n, 1, step, v);
+  return Run<uint16_t>(row, n, 1, step, v);
+}
+
+// 4 float samples to the internal 12-bit precision, 1.0 is mapped to 255 << 4 like 8-bit white.
+// offset is 0.5 for chroma, which is centered at 0.0
+static inline __m128i FloatTo12bit(const float* p, float offset)
+{
+  __m128i xmm0 = _mm_cvtps_epi32(_mm_mul_ps(_mm_add_ps(_mm_loadu_ps(p), _mm_set1_ps(offset)), _mm_set1_ps(255 * 16)));
+  xmm0 = _mm_packs_epi32(xmm0, xmm0);
+  return _mm_min_epi16(_mm_max_epi16(xmm0, _mm_setzero_si128()), _mm_set1_epi16(4095));
+}
 
 // constructor
-MosquitoNR::MosquitoNR(PClip _child, int _strength, int _restore, int _radius, int _threads, IScriptEnvironment* env)
-  : GenericVideoFilter(_child), strength(_strength), restore(_restore), radius(_radius), threads(_threads),
-  width(vi.width), height(vi.height), pitch(((width + 7) & ~7) + 16)
+MosquitoNR::MosquitoNR(PClip _child, int _strength, int _restore, int _radius, int _threads, bool _exact, bool _chroma, bool _interlaced, PClip _mask, int _flat, bool _borders, int _dupes, bool _temporal, const char* _cache, int _iterations, IScriptEnvironment* env)
+  : GenericVideoFilter(_child), strength(_strength), restore(_restore), radius(_radius), flat(_flat), dupes(_dupes), iterations(_iterations), exact(_exact),
+  chroma(_chroma && (vi.IsYUV() || vi.IsYUVA()) && vi.IsPlanar() && !vi.IsY()), interlaced(_interlaced), borders(_borders), temporal(_temporal), threads(_threads), width(vi.width), height(vi.height),
+  strip_width(_mask || _flat || _temporal ? SKIP_STRIP_WIDTH : STRIP_WIDTH), mask(_mask), initialized(false), dup_next(0), cache_file(NULL), cache_map(NULL), cache_slot(0)
 {
   // Check frame property support
   has_at_least_v8 = true;
@@ -37,12 +90,24 @@ MosquitoNR::MosquitoNR(PClip _child, int _strength, int _restore, int _radius, i
   // error checks
   if (!(env->GetCPUFlags() & CPUF_SSSE3))
     env->ThrowError("MosquitoNR: SSSE3 support is required.");
-  if (!(vi.IsYUV() && vi.IsPlanar() && vi.BitsPerComponent() == 8))
-    env->ThrowError("MosquitoNR: input must be 8-bit Y or YUV format.");
-  if (width < 4 || height < 4) env->ThrowError("MosquitoNR: input is too small.");
+  if (!(((vi.IsYUV() || vi.IsYUVA()) && (vi.IsPlanar() || vi.IsYUY2())) || vi.IsPlanarRGB() || vi.IsPlanarRGBA())
+    || !(vi.BitsPerComponent() <= 16 || vi.BitsPerComponent() == 32))
+    env->ThrowError("MosquitoNR: input must be 8-16 bit or float Y, YUV, YUY2 or planar RGB format.");
+  if (width < 4 || height >> interlaced < 4) env->ThrowError("MosquitoNR: input is too small.");
+  if (_chroma && vi.IsYUY2()) env->ThrowError("MosquitoNR: chroma is not supported for YUY2.");
+  if (chroma && ((width >> vi.GetPlaneWidthSubsampling(PLANAR_U)) < 4 || (height >> vi.GetPlaneHeightSubsampling(PLANAR_U) >> interlaced) < 4))
+    env->ThrowError("MosquitoNR: chroma planes are too small.");
   if (strength < 0 || 32 < strength) env->ThrowError("MosquitoNR: strength must be 0-32.");
   if (restore < 0 || 128 < restore) env->ThrowError("MosquitoNR: restore must be 0-128.");
   if (radius < 1 || 2 < radius) env->ThrowError("MosquitoNR: radius must be 1 or 2.");
+  if (flat < 0 || 255 < flat) env->ThrowError("MosquitoNR: flat must be 0-255.");
+  if (dupes < 0 || MAX_DUPES < dupes) env->ThrowError("MosquitoNR: dupes must be 0-%d.", MAX_DUPES);
+  if (iterations < 1 || MAX_ITERATIONS < iterations) env->ThrowError("MosquitoNR: iterations must be 1-%d.", MAX_ITERATIONS);
+  if (mask) {
+    const VideoInfo& mvi = mask->GetVideoInfo();
+    if (mvi.width != width || mvi.height != height || !mvi.IsPlanar() || mvi.BitsPerComponent() != 8)
+      env->ThrowError("MosquitoNR: mask must be an 8-bit planar clip of the same size as the input.");
+  }
   if (threads < 0 || MAX_THREADS < threads) env->ThrowError("MosquitoNR: threads must be 0(auto) or 1-%d.", MAX_THREADS);
 
   // detect the number of processors
@@ -52,85 +117,381 @@ MosquitoNR::MosquitoNR(PClip _child, int _strength, int _restore, int _radius, i
     threads = min(si.dwNumberOfProcessors, MAX_THREADS);
   }
 
-  // allocate buffer and create threads
-  if (!AllocBuffer())
-    env->ThrowError("MosquitoNR: failed to allocate buffer.");
-  if (!mt.CreateThreads(threads, this))
-    env->ThrowError("MosquitoNR: failed to create threads.");
+  // line buffers are shared by all planes
+  const int chroma_width = width >> (chroma ? vi.GetPlaneWidthSubsampling(PLANAR_U) : 0);
+  pitch = borders ? MaxStripColumns(width, strip_width) : StripColumns(width, strip_width);
+  if (chroma) pitch = max(pitch, borders ? MaxStripColumns(chroma_width, strip_width) : StripColumns(chroma_width, strip_width));
+  pitch = PlanPitch(pitch);
+
+  // the cache file is opened here, so that a wrong path is reported when the script is loaded
+  if (_cache && *_cache && strength && !OpenCache(_cache))
+    env->ThrowError("MosquitoNR: cannot open the cache file \"%s\".", _cache);
 
+  // buffers and threads are set up by the first GetFrame, instances that never deliver a frame cost nothing
 }
 
 // destructor
-MosquitoNR::~MosquitoNR() { FreeBuffer(); }
+MosquitoNR::~MosquitoNR()
+{
+  FreeBuffer();
+  CloseCache();
+}
 
 // filter process
 PVideoFrame __stdcall MosquitoNR::GetFrame(int n, IScriptEnvironment* env)
 {
+  if (strength == 0) // do nothing
+    return child->GetFrame(n, env);
+
   src = child->GetFrame(n, env);
+  if (mask) mfr = mask->GetFrame(n, env);
   dst = has_at_least_v8 ? env->NewVideoFrameP(vi, &src) : env->NewVideoFrame(vi);
 
-  // copy chroma
-  if (!vi.IsY8() && vi.IsPlanar()) {
-    env->BitBlt(dst->GetWritePtr(PLANAR_U), dst->GetPitch(PLANAR_U), src->GetReadPtr(PLANAR_U), src->GetPitch(PLANAR_U),
-      src->GetRowSize(PLANAR_U), src->GetHeight(PLANAR_U));
-    env->BitBlt(dst->GetWritePtr(PLANAR_V), dst->GetPitch(PLANAR_V), src->GetReadPtr(PLANAR_V), src->GetPitch(PLANAR_V),
-      src->GetRowSize(PLANAR_V), src->GetHeight(PLANAR_V));
+  // a duplicate of a recent frame gets a copy of its output, with the properties of its own source
+  for (int i = 0; i < dupes; ++i) {
+    if (!dup_src[i] || !SameFrame(src, dup_src[i], vi) || (mask && !SameFrame(mfr, dup_mask[i], mask->GetVideoInfo()))) continue;
+    const int* planes = vi.IsRGB() ? rgb_planes : yuv_planes;
+    for (int p = 0; p < (vi.IsPlanar() && !vi.IsY() ? 3 : 1) + (vi.IsYUVA() || vi.IsPlanarRGBA()); ++p) {
+      const int plane = p < 3 ? planes[p] : PLANAR_A;
+      env->BitBlt(dst->GetWritePtr(plane), dst->GetPitch(plane), dup_dst[i]->GetReadPtr(plane), dup_dst[i]->GetPitch(plane),
+        dup_dst[i]->GetRowSize(plane), dup_dst[i]->GetHeight(plane));
+    }
+    PVideoFrame result = dst;
+    src = NULL;
+    dst = NULL;
+    mfr = NULL;
+    return result;
   }
 
-  if (strength == 0) { // do nothing
-    env->BitBlt(dst->GetWritePtr(), dst->GetPitch(), src->GetReadPtr(), src->GetPitch(), src->GetRowSize(), src->GetHeight());
-    return dst;
+  // the output of an earlier run is read from the cache file, if it was filtered from the same source
+  const bool cached = cache_map && 0 <= n && n < vi.num_frames;
+  const uint64_t hash = cached ? SourceHash() : 0;
+  if (cached && ReadCache(n, hash)) {
+    int copy[3], copies = 0;
+    if (!chroma && (vi.IsYUV() || vi.IsYUVA()) && vi.IsPlanar() && !vi.IsY()) copy[copies++] = PLANAR_U, copy[copies++] = PLANAR_V;
+    if (vi.IsYUVA() || vi.IsPlanarRGBA()) copy[copies++] = PLANAR_A;
+    for (int i = 0; i < copies; ++i)
+      env->BitBlt(dst->GetWritePtr(copy[i]), dst->GetPitch(copy[i]), src->GetReadPtr(copy[i]), src->GetPitch(copy[i]),
+        src->GetRowSize(copy[i]), src->GetHeight(copy[i]));
+    PVideoFrame result = dst;
+    src = NULL;
+    dst = NULL;
+    mfr = NULL;
+    return result;
   }
 
-  CopyLumaFrom();
-  mt.ExecMTFunc(&MosquitoNR::Smoothing);
+  // allocate buffer and create threads, a failure is thrown again by the following frames.
+  // threads that failed to start are not started again, CreateThreads keeps failing
+  if (!initialized) {
+    if (!arena && !AllocBuffer()) {
+      FreeBuffer();
+      env->ThrowError("MosquitoNR: failed to allocate buffer.");
+    }
+    if (!mt.CreateThreads(threads, this))
+      env->ThrowError("MosquitoNR: failed to create threads.");
+    initialized = true;
+  }
 
-  if (restore == 0) { // no restoring
-    CopyLumaTo();
-    return dst;
+  // the constant borders of each plane are found here, so that the threads divide the rest of its rows
+  const int* planes = vi.IsRGB() ? rgb_planes : yuv_planes;
+  for (int p = 0; p < (chroma || vi.IsRGB() ? 3 : 1); ++p) {
+    const int sub_x = chroma && p ? vi.GetPlaneWidthSubsampling(planes[p]) : 0, sub_y = chroma && p ? vi.GetPlaneHeightSubsampling(planes[p]) : 0;
+    const Rect full = { 0, 0, width >> sub_x, height >> sub_y };
+    active[p] = borders ? FindActive(planes[p], full) : full;
   }
 
-  mt.ExecMTFunc(&MosquitoNR::WaveletVert1);
-  mt.ExecMTFunc(&MosquitoNR::WaveletHorz1);
-  mt.ExecMTFunc(&MosquitoNR::WaveletVert2);
+  // the passes are run one after another on the whole frame, as each reads the rows of the other bands from the previous one
+  for (pass = 0; pass < iterations; ++pass)
+    mt.ExecMTFunc(&MosquitoNR::ProcessBand);
+  if (cached) WriteCache(n, hash);
+
+  // the output is kept for duplicates and temporal, so it will be copied before it is written downstream
+  if (dupes) {
+    dup_src[dup_next] = src;
+    dup_mask[dup_next] = mfr;
+    dup_dst[dup_next] = dst;
+    dup_next = (dup_next + 1) % dupes;
+  }
+  if (temporal) {
+    prev_src = src;
+    prev_mask = mfr;
+    prev_dst = dst;
+  }
 
-  if (restore == 128) {
-    mt.ExecMTFunc(&MosquitoNR::WaveletHorz2);
+  // release the frames, so that the output is writable downstream without a copy
+  PVideoFrame result = dst;
+  src = NULL;
+  dst = NULL;
+  mfr = NULL;
+  return result;
+}
+
+// true if all planes of two frames of fvi hold the same samples, the same frame buffer is found without reading it
+bool MosquitoNR::SameFrame(const PVideoFrame& a, const PVideoFrame& b, const VideoInfo& fvi) const
+{
+  const int* planes = fvi.IsRGB() ? rgb_planes : yuv_planes;
+  for (int p = 0; p < (fvi.IsPlanar() && !fvi.IsY() ? 3 : 1) + (fvi.IsYUVA() || fvi.IsPlanarRGBA()); ++p) {
+    const int plane = p < 3 ? planes[p] : PLANAR_A;
+    const BYTE* ap = a->GetReadPtr(plane);
+    const BYTE* bp = b->GetReadPtr(plane);
+    if (ap == bp) continue;
+    const int row_size = a->GetRowSize(plane), a_pitch = a->GetPitch(plane), b_pitch = b->GetPitch(plane);
+    for (int y = 0; y < a->GetHeight(plane); ++y)
+      if (memcmp(ap + y * a_pitch, bp + y * b_pitch, row_size)) return false;
   }
-  else {
-    mt.ExecMTFunc(&MosquitoNR::WaveletHorz3);
-    mt.ExecMTFunc(&MosquitoNR::BlendCoef);
+  return true;
+}
+
+// each plane is divided into horizontal bands of 16-row blocks, one band per thread, the threads go on
+// to their chroma (or B and R) bands after luma (or G). wide planes are also divided into vertical strips, so that the line buffers
+// stay small enough for the cache
+void MosquitoNR::ProcessBand(int thread_id)
+{
+  LineBuffers& b = buf[thread_id];
+
+  // planes not filtered are copied by the threads, each takes its share of the rows (YUY2 chroma is copied with the luma).
+  // the passes of the iterations before the last one keep their output in the stage buffers
+  const bool last = pass + 1 == iterations;
+  int copy[3], copies = 0;
+  if (!chroma && (vi.IsYUV() || vi.IsYUVA()) && vi.IsPlanar() && !vi.IsY()) copy[copies++] = PLANAR_U, copy[copies++] = PLANAR_V;
+  if (vi.IsYUVA() || vi.IsPlanarRGBA()) copy[copies++] = PLANAR_A;
+  for (int i = 0; i < (last ? copies : 0); ++i) {
+    const int src_pitch = src->GetPitch(copy[i]), dst_pitch = dst->GetPitch(copy[i]);
+    const int row_size = src->GetRowSize(copy[i]), rows = src->GetHeight(copy[i]);
+    const BYTE* srcp = src->GetReadPtr(copy[i]);
+    BYTE* dstp = dst->GetWritePtr(copy[i]);
+    for (int y = rows * thread_id / threads; y < rows * (thread_id + 1) / threads; ++y)
+      memcpy(dstp + y * dst_pitch, srcp + y * src_pitch, row_size);
   }
 
-  mt.ExecMTFunc(&MosquitoNR::InvWaveletHorz);
-  mt.ExecMTFunc(&MosquitoNR::InvWaveletVert);
-  CopyLumaTo();
+  const int* planes = vi.IsRGB() ? rgb_planes : yuv_planes;
+  for (int p = 0; p < (chroma || vi.IsRGB() ? 3 : 1); ++p) {
+    const Rect& r = active[p];
+    b.plane = planes[p];
+    b.sub_x = chroma && p ? vi.GetPlaneWidthSubsampling(planes[p]) : 0;
+    b.sub_y = chroma && p ? vi.GetPlaneHeightSubsampling(planes[p]) : 0;
+    const int active_width = r.right - r.left;
+    const int strips = Strips(active_width, strip_width);
+    b.stage_pitch = stage_pitch[p];
+    b.stage_from = pass > 0 ? stage[(pass - 1) & 1][p] : NULL;
+    b.stage_to = last ? NULL : stage[pass & 1][p];
+    if (borders && last) CopyBorders(thread_id, b.plane, r);
+
+    // in interlaced mode, both fields are processed like separate planes of half height
+    for (b.field = 0; b.field <= (int)interlaced; ++b.field) {
+      b.top = interlaced ? (r.top + 1 - b.field) / 2 : r.top;
+      b.height = (interlaced ? (r.bottom + 1 - b.field) / 2 : r.bottom) - b.top;
+      const int y_start = (b.height + 15) / 16 * thread_id / threads * 8; // in rows of vertical approximation coefficients
+      const int y_end = (b.height + 15) / 16 * (thread_id + 1) / threads * 8;
+
+      for (int k = 0; k < strips; ++k) {
+        // strips overlap by STRIP_HALO columns, the wrongly reflected columns at their inner sides are not output
+        b.x_from = r.left + (k > 0 ? (active_width * k / strips) & ~15 : 0);
+        b.x_to = k + 1 < strips ? r.left + ((active_width * (k + 1) / strips) & ~15) : r.right;
+        b.left = max(b.x_from - STRIP_HALO, r.left);
+        b.width = min(b.x_to + STRIP_HALO, r.right) - b.left;
+
+        if (!mask && !flat && !(temporal && prev_src)) {
+          ProcessStrip(thread_id, y_start, y_end);
+          continue;
+        }
+
+        // skipped blocks are copied from the source or the previous output, runs of the other blocks are processed like bands
+        b.scanned = b.compared = 0;
+        for (int y = y_start; y < y_end; ) {
+          int run_end = y;
+          const PVideoFrame* from = NULL;
+          while (run_end < y_end && !(from = SkipBlock(thread_id, run_end))) run_end += 8;
+          if (run_end > y) {
+            ProcessStrip(thread_id, y, run_end);
+            y = run_end;
+            continue;
+          }
+          CopyRows(thread_id, y * 2, min(y * 2 + 16, b.height), *from);
+          y += 8;
+        }
+      }
+    }
+  }
+}
 
-  return dst;
+// finds the part of a plane inside its borders, the rows at the top and bottom and the columns at the sides
+// whose samples are all equal to the top left one. it keeps BORDER_MARGIN samples of the borders and starts
+// on a block, so that the result is the same as processing the whole plane: the borders left out are flat
+// far enough from the picture for the filter not to change them
+Rect MosquitoNR::FindActive(int plane, const Rect& full) const
+{
+  const int w = full.right, h = full.bottom, bits = vi.BitsPerComponent();
+  const int src_pitch = src->GetPitch(plane);
+  const BYTE* srcp = src->GetReadPtr(plane);
+  const BYTE* v = srcp;
+  Rect r = full;
+
+  while (r.top < h && RowRun(srcp + r.top * src_pitch, bits, vi.IsYUY2(), w, 1, v) == w) r.top++;
+  if (r.top == h) { // nothing to filter in a constant plane
+    const Rect none = { 0, 0, 0, 0 };
+    return none;
+  }
+  while (RowRun(srcp + (r.bottom - 1) * src_pitch, bits, vi.IsYUY2(), w, 1, v) == w) r.bottom--;
+
+  r.left = w, r.right = 0;
+  for (int y = r.top; y < r.bottom && (r.left > 0 || r.right < w); y++) {
+    r.left = min(r.left, RowRun(srcp + y * src_pitch, bits, vi.IsYUY2(), w, 1, v));
+    r.right = max(r.right, w - RowRun(srcp + y * src_pitch, bits, vi.IsYUY2(), w, -1, v));
+  }
+
+  // blocks are 16 rows of each field, the left and right edges are kept at 16 columns so that the rows are written aligned.
+  // each pass of the iterations reaches as far into the borders again
+  const int margin = BORDER_MARGIN * iterations;
+  r.top = max(r.top - margin, 0) & ~((16 << interlaced) - 1);
+  r.bottom = min(r.bottom + margin, h);
+  r.left = max(r.left - margin, 0) & ~15;
+  r.right = min((r.right + margin + 15) & ~15, w);
+  return r;
+}
+
+// copies the rows and columns of a plane outside its processed part, each thread takes its share of the rows
+void MosquitoNR::CopyBorders(int thread_id, int plane, const Rect& r)
+{
+  const int src_pitch = src->GetPitch(plane), dst_pitch = dst->GetPitch(plane);
+  const int row_size = src->GetRowSize(plane), rows = src->GetHeight(plane);
+  const int left = vi.BytesFromPixels(r.left), right = vi.BytesFromPixels(r.right);
+  const BYTE* srcp = src->GetReadPtr(plane);
+  BYTE* dstp = dst->GetWritePtr(plane);
+
+  for (int y = rows * thread_id / threads; y < rows * (thread_id + 1) / threads; ++y) {
+    if (y < r.top || y >= r.bottom) {
+      memcpy(dstp + y * dst_pitch, srcp + y * src_pitch, row_size);
+      continue;
+    }
+    memcpy(dstp + y * dst_pitch, srcp + y * src_pitch, left);
+    memcpy(dstp + y * dst_pitch + right, srcp + y * src_pitch + right, row_size - right);
+  }
+}
+
+// processes the blocks y_start to y_end (in rows of vertical approximation coefficients) of the current strip
+void MosquitoNR::ProcessStrip(int thread_id, int y_start, int y_end)
+{
+  const int height = buf[thread_id].height;
+  if (y_start == y_end) return;
+  const int y_last = (height + 15) / 16 * 8; // end of the last block
+
+  if (restore == 0) { // no restoring
+    const int rows_end = min(y_end * 2, height);
+    int loaded = max(y_start * 2 - 2, 0); // next luma row to be loaded
+
+    for (int y = y_start * 2; y < rows_end; y += 16) {
+      const int rows = min(y + 16, rows_end);
+      CopyLumaFrom(thread_id, loaded, min(rows + 2, height));
+      loaded = min(rows + 2, height);
+      Smoothing(thread_id, y, rows);
+      CopyLumaTo(thread_id, 1, y, rows);
+    }
+    return;
+  }
+
+  // the forward transform of a block reads blurred rows from 2 rows above to 2 rows below it,
+  // so rows of the neighboring bands are loaded and blurred again at the band edges
+  int loaded = max(y_start * 2 - 4, 0); // next luma row to be loaded
+  int smoothed = max(y_start * 2 - 2, 0); // next luma row to be blurred
+  int diffed = smoothed; // next luma row to be replaced with the difference
+
+  // exact: the vertical detail coefficients replace the odd rows of luma[1],
+  //        and the restored rows are written to luma[0] after the original rows are no longer needed
+  // !exact: the difference replaces the original rows of luma[0], so blurring runs 2 rows ahead of it,
+  //        and the restored low frequency band is added to luma[1]
+  const int out = exact ? 0 : 1;
+
+  // the first block below the band is transformed too, the last vertical inverse step needs its first row
+  for (int y = y_start; y <= y_end; y += 8)
+  {
+    if (y < y_last) {
+      const int rows = min(y * 2 + 17, height);
+      const int blur_rows = exact ? rows : min(rows + 2, height);
+      CopyLumaFrom(thread_id, loaded, min(blur_rows + 2, height));
+      loaded = min(blur_rows + 2, height);
+      Smoothing(thread_id, smoothed, blur_rows);
+      smoothed = blur_rows;
+
+      if (!exact) { // restore the low frequency band of the difference
+        DiffLuma(thread_id, diffed, rows);
+        diffed = rows;
+      }
+
+      WaveletApprox1(thread_id, y);
+      if (exact) {
+        if (y == y_start && y > 0) WaveletDetail(thread_id, y - 1); // last detail row of the band above
+        Wavelet2(thread_id, y);
+        InvWaveletHorz(thread_id, y);
+      }
+      else InvApproxHorz(thread_id, y);
+    }
+
+    if (y == y_start) continue;
+
+    if (exact) InvWaveletVert(thread_id, y - 8);
+    else InvApproxVert(thread_id, y - 8);
+    CopyLumaTo(thread_id, out, (y - 8) * 2, min(y * 2, height));
+  }
 }
 
 void MosquitoNR::InitBuffer()
 {
-  luma[0] = luma[1] = bufy[0] = bufy[1] = bufx[0] = bufx[1] = NULL;
-  for (int i = 0; i < MAX_THREADS; ++i) work[i] = NULL;
+  arena = NULL;
+  for (int i = 0; i < 2; ++i)
+    stage[i][0] = stage[i][1] = stage[i][2] = NULL;
+  stage_pitch[0] = stage_pitch[1] = stage_pitch[2] = 0;
+  for (int i = 0; i < MAX_THREADS; ++i) {
+    LineBuffers& b = buf[i];
+    b.work = b.luma[0] = b.luma[1] = b.bufx[0] = b.bufx[1] = b.blend = NULL;
+  }
 }
 
 bool MosquitoNR::AllocBuffer()
 {
   FreeBuffer();
 
-  luma[0] = (short*)_aligned_malloc((((height + 7) & ~7) + 4) * pitch * sizeof(short), 16);
-  luma[1] = (short*)_aligned_malloc((((height + 7) & ~7) + 4) * pitch * sizeof(short), 16);
-  bufy[0] = (short*)_aligned_malloc(((((height + 15) & ~15) / 2) + 1) * pitch * sizeof(short), 16);
-  bufy[1] = (short*)_aligned_malloc(((((height + 15) & ~15) / 2) + 2) * pitch * sizeof(short), 16);
-  bufx[0] = (short*)_aligned_malloc((((height + 15) & ~15) / 4) * pitch * sizeof(short), 16);
-  bufx[1] = (short*)_aligned_malloc((((height + 15) & ~15) / 4) * pitch * sizeof(short), 16);
+  // rows of each buffer, 4 rows hold one block of shuffled coefficients.
+  // restore=0 only blurs, so it needs the luma rings alone
+  const int work_rows = restore ? 32 : 0, luma_rows = LUMA_RING * 2, bufx_rows = restore ? 4 * 2 : 0, mask_rows = mask || flat ? 2 : 0;
+  // pitch is a multiple of 64 bytes, so every slice starts at a cache line and threads never write to the same line
+  const size_t slice = (size_t)(work_rows + luma_rows + bufx_rows + mask_rows) * pitch;
+  const size_t size = slice * threads * sizeof(short);
 
-  if (!luma[0] || !luma[1] || !bufy[0] || !bufy[1] || !bufx[0] || !bufx[1]) return false;
+  arena = _aligned_malloc(size, 64);
+  if (!arena) return false;
 
   for (int i = 0; i < threads; ++i) {
-    work[i] = (short*)_aligned_malloc(8 * pitch * sizeof(short), 16);
-    if (!work[i]) return false;
+    LineBuffers& b = buf[i];
+    b.luma[0] = (short*)arena + slice * i;
+    b.luma[1] = b.luma[0] + LUMA_RING * pitch;
+    if (mask_rows) b.blend = b.luma[1] + (LUMA_RING + work_rows + bufx_rows) * pitch;
+    if (!restore) continue;
+    b.work = b.luma[1] + LUMA_RING * pitch;
+    b.bufx[0] = b.work + work_rows * pitch;
+    b.bufx[1] = b.bufx[0] + 4 * pitch;
+  }
+
+  // the stage buffers hold whole planes, the passes of the iterations read the rows of all bands of the previous one
+  if (iterations > 1) {
+    const int* planes = vi.IsRGB() ? rgb_planes : yuv_planes;
+    size_t stage_size = 0;
+    for (int p = 0; p < (chroma || vi.IsRGB() ? 3 : 1); ++p) {
+      const int sub_x = chroma && p ? vi.GetPlaneWidthSubsampling(planes[p]) : 0, sub_y = chroma && p ? vi.GetPlaneHeightSubsampling(planes[p]) : 0;
+      stage_pitch[p] = ((width >> sub_x) + 31) & ~31; // a multiple of 64 bytes
+      stage_size += (size_t)stage_pitch[p] * (height >> sub_y);
+    }
+    short* stage_arena = (short*)_aligned_malloc(stage_size * 2 * sizeof(short), 64);
+    if (!stage_arena) {
+      FreeBuffer(); // no arena is left without its stage buffers
+      return false;
+    }
+    for (int i = 0; i < 2; ++i)
+      for (int p = 0; p < (chroma || vi.IsRGB() ? 3 : 1); ++p) {
+        const int sub_y = chroma && p ? vi.GetPlaneHeightSubsampling(planes[p]) : 0;
+        stage[i][p] = stage_arena;
+        stage_arena += (size_t)stage_pitch[p] * (height >> sub_y);
+      }
   }
 
   return true;
@@ -138,77 +499,196 @@ bool MosquitoNR::AllocBuffer()
 
 void MosquitoNR::FreeBuffer()
 {
-  _aligned_free(luma[0]); _aligned_free(luma[1]);
-  _aligned_free(bufy[0]); _aligned_free(bufy[1]);
-  _aligned_free(bufx[0]); _aligned_free(bufx[1]);
-
-  for (int i = 0; i < threads; ++i) _aligned_free(work[i]);
+  _aligned_free(arena);
+  _aligned_free(stage[0][0]);
 
   InitBuffer();
 }
 
-void MosquitoNR::CopyLumaFrom()
+// row: destination of a single row instead of the luma ring
+void MosquitoNR::CopyLumaFrom(int thread_id, int y_from, int y_to, short* row)
 {
-  const int src_pitch = src->GetPitch();
-  const auto dst_pitch = pitch * sizeof(short);
-  const int height = this->height;
-  const BYTE* srcp = src->GetReadPtr();
-  short* dstp = luma[0];
-
-  const int hloop = (width + 15) / 16;
+  const LineBuffers& b = buf[thread_id];
+  const int width = b.width;
+  const int src_pitch = src->GetPitch(b.plane) << interlaced; // rows of a field are every other row
+  const BYTE* srcp = src->GetReadPtr(b.plane) + ((b.top << interlaced) + b.field) * src->GetPitch(b.plane) + vi.BytesFromPixels(b.left);
+
+  const int bits = vi.BitsPerComponent();
+  const float offset = chroma && b.plane != PLANAR_Y ? 0.5f : 0.0f;
+  const int hloop = bits == 32 ? (width + 3) / 4 : vi.IsYUY2() || bits > 8 ? (width + 7) / 8 : (width + 15) / 16;
+
+  if (b.stage_from && !row) { // the output of the previous pass is already in 12-bit precision
+    for (int y = y_from; y < y_to; y++) {
+      short* p = LumaRow(thread_id, 0, y);
+      memcpy(p, StageRow(thread_id, b.stage_from, y) + b.left, width * sizeof(short));
+      p[-2] = p[2], p[-1] = p[1], p[width] = p[width - 2], p[width + 1] = p[width - 3];
+    }
+    return;
+  }
 
-  __m128i xmm0, xmm1, xmm7;
-  uint8_t* edi = (uint8_t*)(dstp + 2 * pitch + 8); // edi = dstp + 2 * pitch + 8
+  __m128i xmm0, xmm1, xmm5, xmm6, xmm7;
 
+  xmm5 = _mm_cvtsi32_si128(bits > 12 ? bits - 12 : 12 - bits); // shift to the internal 12-bit precision
+  xmm6 = _mm_set1_epi16(0x00ff); // luma bytes of YUY2
   xmm7 = _mm_setzero_si128();
 
-  for (int y = 0; y < height; y++) {
-    //next16pixels_planar :
-    for (int x = 0; x < hloop; x++) {
-      xmm0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcp + x * 16)); // movdqu xmm0, [esi]
-      xmm1 = xmm0;
-      xmm0 = _mm_unpacklo_epi8(xmm0, xmm7);
-      xmm1 = _mm_unpackhi_epi8(xmm1, xmm7);
-      xmm0 = _mm_slli_epi16(xmm0, 4); // convert to internal 12-bit precision
-      xmm1 = _mm_slli_epi16(xmm1, 4); // convert to internal 12-bit precision
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi + x * 32), xmm0);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi + x * 32 + 16), xmm1);
-    } // sub edx, 1         jnz next16pixels_planar
-
-    srcp += src_pitch; // add esi, eax
-    edi += dst_pitch; // add edi, ebx
-  }
-
-  // horizontal reflection
-  short* p = luma[0] + 2 * pitch + 8;
-  for (int y = 0; y < height; ++y, p += pitch)
+  for (int y = y_from; y < y_to; y++) {
+    const uint8_t* esi = srcp + y * src_pitch;
+    short* dstp = row ? row : LumaRow(thread_id, 0, y);
+    uint8_t* edi = (uint8_t*)dstp;
+
+    if (bits == 32) {
+      //next4pixels_float :
+      for (int x = 0; x < hloop; x++)
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(edi + x * 8), FloatTo12bit(reinterpret_cast<const float*>(esi) + x * 4, offset));
+    }
+    else if (bits > 8) {
+      //next8pixels_16bit :
+      for (int x = 0; x < hloop; x++) {
+        xmm0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(esi + x * 16));
+        xmm0 = bits > 12 ? _mm_srl_epi16(xmm0, xmm5) : _mm_sll_epi16(xmm0, xmm5);
+        _mm_store_si128(reinterpret_cast<__m128i*>(edi + x * 16), xmm0);
+      }
+    }
+    else if (vi.IsYUY2()) {
+      //next8pixels_yuy2 :
+      for (int x = 0; x < hloop; x++) {
+        xmm0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(esi + x * 16));
+        xmm0 = _mm_and_si128(xmm0, xmm6);
+        xmm0 = _mm_slli_epi16(xmm0, 4); // convert to internal 12-bit precision
+        _mm_store_si128(reinterpret_cast<__m128i*>(edi + x * 16), xmm0);
+      }
+    }
+    else {
+      //next16pixels_planar :
+      for (int x = 0; x < hloop; x++) {
+        xmm0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(esi + x * 16)); // movdqu xmm0, [esi]
+        xmm1 = xmm0;
+        xmm0 = _mm_unpacklo_epi8(xmm0, xmm7);
+        xmm1 = _mm_unpackhi_epi8(xmm1, xmm7);
+        xmm0 = _mm_slli_epi16(xmm0, 4); // convert to internal 12-bit precision
+        xmm1 = _mm_slli_epi16(xmm1, 4); // convert to internal 12-bit precision
+        _mm_store_si128(reinterpret_cast<__m128i*>(edi + x * 32), xmm0);
+        _mm_store_si128(reinterpret_cast<__m128i*>(edi + x * 32 + 16), xmm1);
+      } // sub edx, 1         jnz next16pixels_planar
+    }
+
+    // horizontal reflection
+    short* p = dstp;
     p[-2] = p[2], p[-1] = p[1], p[width] = p[width - 2], p[width + 1] = p[width - 3];
-
-  // vertical reflection
-  memcpy(luma[0], luma[0] + 4 * pitch, pitch * sizeof(short));
-  memcpy(luma[0] + pitch, luma[0] + 3 * pitch, pitch * sizeof(short));
-  memcpy(luma[0] + (height + 2) * pitch, luma[0] + height * pitch, pitch * sizeof(short));
-  memcpy(luma[0] + (height + 3) * pitch, luma[0] + (height - 1) * pitch, pitch * sizeof(short));
+  }
 }
 
-void MosquitoNR::CopyLumaTo()
+void MosquitoNR::CopyLumaTo(int thread_id, int k, int y_from, int y_to)
 {
-  const int src_pitch = pitch * sizeof(short);
-  const int dst_pitch = dst->GetPitch();
-  const int height = this->height;
-  short* srcp = luma[1];
-  BYTE* dstp = dst->GetWritePtr();
+  const LineBuffers& b = buf[thread_id];
+  const int src_pitch = src->GetPitch(b.plane) << interlaced, dst_pitch = dst->GetPitch(b.plane) << interlaced; // rows of a field are every other row
+  const BYTE* srcp = src->GetReadPtr(b.plane) + ((b.top << interlaced) + b.field) * src->GetPitch(b.plane) + vi.BytesFromPixels(b.x_from);
+  BYTE* dstp = dst->GetWritePtr(b.plane) + ((b.top << interlaced) + b.field) * dst->GetPitch(b.plane) + vi.BytesFromPixels(b.x_from);
+
+  const int bits = vi.BitsPerComponent();
+  const float offset = chroma && b.plane != PLANAR_Y ? 0.5f : 0.0f;
+  const int columns = b.x_to - b.x_from;
+
+  if (b.stage_to) { // a pass before the last one keeps the internal precision, the mask is applied by the last one
+    __m128i xmm0, xmm7;
+    xmm7 = _mm_set1_epi16(4095); // maximum value of 12 bits
+    for (int y = y_from; y < y_to; y++) {
+      const short* esi = LumaRow(thread_id, k, y) + b.x_from - b.left;
+      short* edi = StageRow(thread_id, b.stage_to, y) + b.x_from;
+      for (int x = 0; x < columns; x += 8) {
+        xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + x));
+        xmm0 = _mm_max_epi16(xmm0, _mm_setzero_si128());
+        xmm0 = _mm_min_epi16(xmm0, xmm7);
+        _mm_store_si128(reinterpret_cast<__m128i*>(edi + x), xmm0);
+      }
+    }
+    return;
+  }
 
-  const int hloop = (width + 15) / 16;
+  if (mask) ApplyMask(thread_id, k, y_from, y_to);
+  const int hloop = bits == 32 ? (columns + 3) / 4 : vi.IsYUY2() || bits > 8 ? (columns + 7) / 8 : (columns + 15) / 16;
 
-  __m128i xmm0, xmm1, xmm7;
-  uint8_t* esi = (uint8_t*)(srcp + 2 * pitch + 8); // // esi = srcp + 2 * pitch + 8
-  uint8_t* edi = (uint8_t*)dstp; //   mov edi, dstp // edi = dstp
+  __m128i xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7;
 
+  xmm4 = _mm_set1_epi16((short)((1 << min(bits, 16)) - 1)); // maximum value of 10-14 bits
+  xmm5 = _mm_cvtsi32_si128(bits > 12 ? bits - 12 : 12 - bits); // shift from the internal 12-bit precision
+  xmm6 = _mm_set1_epi16((short)0xff00); // chroma bytes of YUY2
   xmm7 = _mm_set1_epi16(8); // xmm7 = [0x0008] * 8 rounder
+  if (bits > 8) xmm7 = _mm_set1_epi16((short)(bits < 12 ? 1 << (11 - bits) : 0));
 
   // nextrow_planar:
-  for (int y = 0; y < height; y++) {
+  for (int y = y_from; y < y_to; y++) {
+    uint8_t* esi = (uint8_t*)(LumaRow(thread_id, k, y) + b.x_from - b.left);
+    uint8_t* edi = dstp + y * dst_pitch;
+
+    if (bits == 32) {
+      // the change is added to the source like above 12 bits
+      const float* orig = reinterpret_cast<const float*>(srcp + y * src_pitch);
+
+      //next4pixels_float :
+      for (int x = 0; x < hloop; x++) {
+        xmm0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(esi + x * 8));
+        xmm0 = _mm_min_epi16(_mm_max_epi16(xmm0, _mm_setzero_si128()), _mm_set1_epi16(4095)); // clamped like the integer outputs
+        xmm0 = _mm_sub_epi16(xmm0, FloatTo12bit(orig + x * 4, offset));
+        xmm0 = _mm_srai_epi32(_mm_unpacklo_epi16(xmm0, xmm0), 16); // sign extension
+        __m128 change = _mm_mul_ps(_mm_cvtepi32_ps(xmm0), _mm_set1_ps(1.0f / (255 * 16)));
+        _mm_store_ps(reinterpret_cast<float*>(edi) + x * 4, _mm_add_ps(_mm_loadu_ps(orig + x * 4), change));
+      }
+      continue;
+    }
+
+    if (bits > 12) {
+      // only the change is scaled up and added to the source, so that the lower bits of unchanged pixels are kept
+      const uint8_t* orig = srcp + y * src_pitch;
+
+      //next8pixels_16bit :
+      for (int x = 0; x < hloop; x++) {
+        xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + x * 16));
+        xmm1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(orig + x * 16));
+        xmm0 = _mm_sub_epi16(xmm0, _mm_srl_epi16(xmm1, xmm5)); // change in 12-bit precision
+        xmm2 = _mm_max_epi16(xmm0, _mm_setzero_si128());
+        xmm3 = _mm_max_epi16(_mm_sub_epi16(_mm_setzero_si128(), xmm0), _mm_setzero_si128());
+        xmm1 = _mm_adds_epu16(xmm1, _mm_sll_epi16(xmm2, xmm5));
+        xmm1 = _mm_subs_epu16(xmm1, _mm_sll_epi16(xmm3, xmm5));
+        if (bits < 16) xmm1 = _mm_min_epi16(xmm1, xmm4);
+        _mm_store_si128(reinterpret_cast<__m128i*>(edi + x * 16), xmm1);
+      }
+      continue;
+    }
+
+    if (bits > 8) {
+      //next8pixels_16bit :
+      for (int x = 0; x < hloop; x++) {
+        xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + x * 16));
+        xmm0 = _mm_add_epi16(xmm0, xmm7);
+        xmm0 = _mm_sra_epi16(xmm0, xmm5);
+        xmm0 = _mm_max_epi16(xmm0, _mm_setzero_si128());
+        xmm0 = _mm_min_epi16(xmm0, xmm4);
+        _mm_store_si128(reinterpret_cast<__m128i*>(edi + x * 16), xmm0);
+      }
+      continue;
+    }
+
+    if (vi.IsYUY2()) {
+      // the chroma bytes of the source are put back between the luma bytes
+      const uint8_t* chroma = srcp + y * src_pitch;
+
+      //next8pixels_yuy2 :
+      for (int x = 0; x < hloop; x++) {
+        xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + x * 16));
+        xmm1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chroma + x * 16));
+        xmm0 = _mm_add_epi16(xmm0, xmm7);
+        xmm0 = _mm_srai_epi16(xmm0, 4);
+        xmm0 = _mm_packus_epi16(xmm0, xmm0); // saturate to 0-255
+        xmm0 = _mm_unpacklo_epi8(xmm0, _mm_setzero_si128());
+        xmm1 = _mm_and_si128(xmm1, xmm6);
+        xmm0 = _mm_or_si128(xmm0, xmm1);
+        _mm_store_si128(reinterpret_cast<__m128i*>(edi + x * 16), xmm0);
+      }
+      continue;
+    }
+
     //next16pixels_planar :
     for (int x = 0; x < hloop; x++) {
       xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + x * 32));
@@ -222,38 +702,215 @@ void MosquitoNR::CopyLumaTo()
       xmm0 = _mm_packus_epi16(xmm0, xmm1); //  packuswb xmm0, xmm1
       _mm_store_si128(reinterpret_cast<__m128i*>(edi + x * 16), xmm0);
     } // sub edx, 1  jnz next16pixels_planar
-
-    esi += src_pitch; // add esi, eax
-    edi += dst_pitch; // add edi, ebx
   }
 }
 
-void MosquitoNR::Smoothing(int thread_id)
+// true if the mask is 0 for all pixels of rows y_from to y_to of the current strip
+bool MosquitoNR::MaskedOut(int thread_id, int y_from, int y_to) const
 {
-  SmoothingSSSE3(thread_id);
+  const LineBuffers& b = buf[thread_id];
+  const int mask_pitch = mfr->GetPitch();
+  const int x_from = b.x_from << b.sub_x, x_to = min(b.x_to << b.sub_x, width);
+
+  for (int y = y_from; y < y_to; y++) {
+    const BYTE* maskp = mfr->GetReadPtr() + MaskRow(thread_id, y) * mask_pitch;
+    for (int x = x_from; x < x_to; x++)
+      if (maskp[x]) return false;
+  }
+  return true;
 }
 
-AVSValue __cdecl CreateMosquitoNR(AVSValue args, void* user_data, IScriptEnvironment* env)
+// true if the samples of rows y_from to y_to of the current strip and its halo vary by less than flat (8-bit units,
+// scaled to the depth of the source), so that flat=1 only finds constant rows at any depth.
+// each row is scanned once, the footprints of the following blocks overlap
+bool MosquitoNR::Flat(int thread_id, int y_from, int y_to)
 {
-  const VideoInfo& vi_orig = args[0].AsClip()->GetVideoInfo();
+  LineBuffers& b = buf[thread_id];
+  const int bits = vi.BitsPerComponent();
+  const int src_pitch = src->GetPitch(b.plane) << interlaced; // rows of a field are every other row
+  const BYTE* srcp = src->GetReadPtr(b.plane) + ((b.top << interlaced) + b.field) * src->GetPitch(b.plane) + vi.BytesFromPixels(b.left);
+  short* row = b.blend + 8;
 
-  AVSValue new_args[1] = { args[0].AsClip() };
-  PClip clip;
-  if (vi_orig.IsYUY2()) {
-    clip = env->Invoke("ConvertToYV16", AVSValue(new_args, 1)).AsClip();
+  __m128i xmm0, xmm1, xmm7;
+  __m128 xmm2, xmm3;
+
+  xmm7 = _mm_set1_epi16((short)0x8000); // unsigned to signed order
+
+  for (b.scanned = max(b.scanned, y_from); b.scanned < y_to; b.scanned++) {
+    if (bits == 32) {
+      // float samples are compared as they are, their conversion to 12 bits is not exact
+      const float* p = reinterpret_cast<const float*>(srcp + b.scanned * src_pitch);
+      const int columns = b.width & ~3;
+      float lo = p[0], hi = p[0];
+      xmm2 = xmm3 = _mm_set1_ps(lo);
+      for (int x = 0; x < columns; x += 4) {
+        xmm2 = _mm_min_ps(xmm2, _mm_loadu_ps(p + x));
+        xmm3 = _mm_max_ps(xmm3, _mm_loadu_ps(p + x));
+      }
+      for (int x = columns; x < b.width; x++) {
+        lo = min(lo, p[x]);
+        hi = max(hi, p[x]);
+      }
+      xmm2 = _mm_min_ps(xmm2, _mm_shuffle_ps(xmm2, xmm2, _MM_SHUFFLE(1, 0, 3, 2)));
+      xmm2 = _mm_min_ps(xmm2, _mm_shuffle_ps(xmm2, xmm2, _MM_SHUFFLE(2, 3, 0, 1)));
+      xmm3 = _mm_max_ps(xmm3, _mm_shuffle_ps(xmm3, xmm3, _MM_SHUFFLE(1, 0, 3, 2)));
+      xmm3 = _mm_max_ps(xmm3, _mm_shuffle_ps(xmm3, xmm3, _MM_SHUFFLE(2, 3, 0, 1)));
+      b.row_min[b.scanned & (SCAN_RING - 1)] = min(lo, _mm_cvtss_f32(xmm2));
+      b.row_max[b.scanned & (SCAN_RING - 1)] = max(hi, _mm_cvtss_f32(xmm3));
+      continue;
+    }
+
+    // 8-bit samples are exact in 12 bits, deeper ones are compared at their own depth so that their low bits count
+    if (bits > 8) {
+      const BYTE* p = srcp + b.scanned * src_pitch;
+      for (int x = 0; x < b.width; x += 8)
+        _mm_store_si128(reinterpret_cast<__m128i*>(row + x), _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + x * 2)), xmm7));
+    }
+    else CopyLumaFrom(thread_id, b.scanned, b.scanned + 1, row);
+
+    const int columns = b.width & ~7;
+    short lo = row[0], hi = row[0];
+    xmm0 = xmm1 = _mm_set1_epi16(lo);
+    for (int x = 0; x < columns; x += 8) {
+      xmm0 = _mm_min_epi16(xmm0, _mm_load_si128(reinterpret_cast<const __m128i*>(row + x)));
+      xmm1 = _mm_max_epi16(xmm1, _mm_load_si128(reinterpret_cast<const __m128i*>(row + x)));
+    }
+    for (int x = columns; x < b.width; x++) {
+      lo = min(lo, row[x]);
+      hi = max(hi, row[x]);
+    }
+
+    // horizontal minimum and maximum
+    xmm0 = _mm_min_epi16(xmm0, _mm_shuffle_epi32(xmm0, _MM_SHUFFLE(1, 0, 3, 2)));
+    xmm0 = _mm_min_epi16(xmm0, _mm_shuffle_epi32(xmm0, _MM_SHUFFLE(2, 3, 0, 1)));
+    xmm0 = _mm_min_epi16(xmm0, _mm_shufflelo_epi16(xmm0, _MM_SHUFFLE(2, 3, 0, 1)));
+    xmm1 = _mm_max_epi16(xmm1, _mm_shuffle_epi32(xmm1, _MM_SHUFFLE(1, 0, 3, 2)));
+    xmm1 = _mm_max_epi16(xmm1, _mm_shuffle_epi32(xmm1, _MM_SHUFFLE(2, 3, 0, 1)));
+    xmm1 = _mm_max_epi16(xmm1, _mm_shufflelo_epi16(xmm1, _MM_SHUFFLE(2, 3, 0, 1)));
+    b.row_min[b.scanned & (SCAN_RING - 1)] = min(lo, (short)_mm_cvtsi128_si32(xmm0));
+    b.row_max[b.scanned & (SCAN_RING - 1)] = max(hi, (short)_mm_cvtsi128_si32(xmm1));
+  }
+
+  float lo = b.row_min[y_from & (SCAN_RING - 1)], hi = b.row_max[y_from & (SCAN_RING - 1)];
+  for (int y = y_from + 1; y < y_to; y++) {
+    lo = min(lo, b.row_min[y & (SCAN_RING - 1)]);
+    hi = max(hi, b.row_max[y & (SCAN_RING - 1)]);
+  }
+
+  // an 8-bit step is 16 in 12 bits, 1 << (bits - 8) above 8 bits and 1/255 in float
+  const float step = bits == 32 ? 1.0f / 255 : bits > 8 ? (float)(1 << (bits - 8)) : 16.0f;
+  return hi - lo <= (flat - 1) * step;
+}
+
+// true if rows y_from to y_to of the current strip and its halo are the same in the previous source,
+// each row is compared once, the footprints of the following blocks overlap
+bool MosquitoNR::Unchanged(int thread_id, int y_from, int y_to)
+{
+  LineBuffers& b = buf[thread_id];
+  const int src_pitch = src->GetPitch(b.plane) << interlaced, prev_pitch = prev_src->GetPitch(b.plane) << interlaced;
+  const BYTE* srcp = src->GetReadPtr(b.plane) + ((b.top << interlaced) + b.field) * src->GetPitch(b.plane) + vi.BytesFromPixels(b.left);
+  const BYTE* prevp = prev_src->GetReadPtr(b.plane) + ((b.top << interlaced) + b.field) * prev_src->GetPitch(b.plane) + vi.BytesFromPixels(b.left);
+
+  for (b.compared = max(b.compared, y_from); b.compared < y_to; b.compared++)
+    b.row_same[b.compared & (SCAN_RING - 1)] = !memcmp(srcp + b.compared * src_pitch, prevp + b.compared * prev_pitch, vi.BytesFromPixels(b.width));
+
+  for (int y = y_from; y < y_to; y++)
+    if (!b.row_same[y & (SCAN_RING - 1)]) return false;
+  if (!mask) return true;
+
+  // the output is blended by the mask, so it must be the same too
+  const int mask_pitch = mfr->GetPitch(), prev_mask_pitch = prev_mask->GetPitch();
+  const int x_from = b.x_from << b.sub_x, x_to = min(b.x_to << b.sub_x, width);
+  for (int y = y_from; y < y_to; y++) {
+    const int row = MaskRow(thread_id, y);
+    if (memcmp(mfr->GetReadPtr() + row * mask_pitch + x_from, prev_mask->GetReadPtr() + row * prev_mask_pitch + x_from, x_to - x_from)) return false;
   }
-  else {
-    clip = args[0].AsClip();
+  return true;
+}
+
+// the frame the block at row y (of vertical approximation coefficients) of the current strip is copied from
+// instead of being filtered: the source if it is masked out or flat, the previous output if it is unchanged
+const PVideoFrame* MosquitoNR::SkipBlock(int thread_id, int y)
+{
+  // blocks masked out or flat are left as they are by every pass, unchanged ones are copied by the last one.
+  // all passes test the source samples at their own depth, never the 12-bit stage, so that they skip the same blocks.
+  // the output of the passes depends on a halo for each of them
+  const int height = buf[thread_id].height, halo = BLOCK_HALO * iterations;
+  if (mask && MaskedOut(thread_id, y * 2, min(y * 2 + 16, height))) return &src;
+  if (temporal && prev_src && pass + 1 == iterations && Unchanged(thread_id, max(y * 2 - halo, 0), min(y * 2 + 16 + halo, height))) return &prev_dst;
+  if (flat && Flat(thread_id, max(y * 2 - halo, 0), min(y * 2 + 16 + halo, height))) return &src;
+  return NULL;
+}
+
+// copies rows y_from to y_to of the current strip from the source or the previous output
+void MosquitoNR::CopyRows(int thread_id, int y_from, int y_to, const PVideoFrame& from)
+{
+  const LineBuffers& b = buf[thread_id];
+  if (b.stage_to) { // a pass before the last one, the source rows are kept in the stage buffer for the halo of the next pass
+    short* row = b.blend + 8;
+    for (int y = y_from; y < y_to; y++) {
+      CopyLumaFrom(thread_id, y, y + 1, row);
+      memcpy(StageRow(thread_id, b.stage_to, y) + b.x_from, row + b.x_from - b.left, (b.x_to - b.x_from) * sizeof(short));
+    }
+    return;
   }
 
-  auto Result = new MosquitoNR(clip, args[1].AsInt(16), args[2].AsInt(128), args[3].AsInt(2), args[4].AsInt(0), env);
+  const int src_pitch = from->GetPitch(b.plane) << interlaced, dst_pitch = dst->GetPitch(b.plane) << interlaced;
+  const BYTE* srcp = from->GetReadPtr(b.plane) + ((b.top << interlaced) + b.field) * from->GetPitch(b.plane) + vi.BytesFromPixels(b.x_from);
+  BYTE* dstp = dst->GetWritePtr(b.plane) + ((b.top << interlaced) + b.field) * dst->GetPitch(b.plane) + vi.BytesFromPixels(b.x_from);
 
-  if (vi_orig.IsYUY2()) {
-    AVSValue new_args2[1] = { Result };
-    return env->Invoke("ConvertToYUY2", AVSValue(new_args2, 1)).AsClip();
+  for (int y = y_from; y < y_to; y++)
+    memcpy(dstp + y * dst_pitch, srcp + y * src_pitch, vi.BytesFromPixels(b.x_to - b.x_from));
+}
+
+// blends the filtered rows of luma[k] with the source rows by the mask
+void MosquitoNR::ApplyMask(int thread_id, int k, int y_from, int y_to)
+{
+  const LineBuffers& b = buf[thread_id];
+  const int mask_pitch = mfr->GetPitch();
+  const int first = b.x_from - b.left, last = b.left + b.width - 1;
+  const int hloop = (b.x_to - b.x_from + 7) / 8;
+  short* orig = b.blend + 8;
+  short* factor = b.blend + pitch + 8;
+
+  const __m128i round = _mm_set1_epi32(0x4000);
+  __m128i xmm0, xmm1, xmm2, xmm3;
+
+  for (int y = y_from; y < y_to; y++) {
+    CopyLumaFrom(thread_id, y, y + 1, orig);
+
+    // 0-255 to 0-32767 in 1.15 fixed point, 255 keeps the difference as it is
+    const BYTE* maskp = mfr->GetReadPtr() + MaskRow(thread_id, y) * mask_pitch;
+    for (int x = b.x_from; x < b.x_from + hloop * 8; x++) {
+      const int m = maskp[min(x, last) << b.sub_x];
+      factor[x - b.left] = (short)(m * 128 + (m >> 1));
+    }
+
+    short* dstp = LumaRow(thread_id, k, y);
+    for (int x = first; x < first + hloop * 8; x += 8) {
+      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(orig + x));
+      xmm0 = _mm_sub_epi16(_mm_load_si128(reinterpret_cast<const __m128i*>(dstp + x)), xmm1);
+      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(factor + x));
+      xmm3 = _mm_mulhi_epi16(xmm0, xmm2);
+      xmm0 = _mm_mullo_epi16(xmm0, xmm2);
+      xmm2 = _mm_unpacklo_epi16(xmm0, xmm3);
+      xmm0 = _mm_unpackhi_epi16(xmm0, xmm3);
+      xmm2 = _mm_srai_epi32(_mm_add_epi32(xmm2, round), 15);
+      xmm0 = _mm_srai_epi32(_mm_add_epi32(xmm0, round), 15);
+      xmm0 = _mm_packs_epi32(xmm2, xmm0);
+      _mm_store_si128(reinterpret_cast<__m128i*>(dstp + x), _mm_add_epi16(xmm0, xmm1));
+    }
   }
+}
+
+void MosquitoNR::Smoothing(int thread_id, int y_from, int y_to)
+{
+  SmoothingSSSE3(thread_id, y_from, y_to);
+}
 
-  return Result;
+AVSValue __cdecl CreateMosquitoNR(AVSValue args, void* user_data, IScriptEnvironment* env)
+{
+  return new MosquitoNR(args[0].AsClip(), args[1].AsInt(16), args[2].AsInt(128), args[3].AsInt(2), args[4].AsInt(0), args[5].AsBool(true), args[6].AsBool(false), args[7].AsBool(false), args[8].Defined() ? args[8].AsClip() : NULL, args[9].AsInt(0), args[10].AsBool(false), args[11].AsInt(0), args[12].AsBool(false), args[13].AsString(""), args[14].AsInt(1), env);
 }
 
 const AVS_Linkage* AVS_linkage = nullptr;
@@ -262,6 +919,6 @@ extern "C" __declspec(dllexport) const char* __stdcall AvisynthPluginInit3(IScri
 {
   AVS_linkage = vectors;
 
-  env->AddFunction("MosquitoNR", "c[strength]i[restore]i[radius]i[threads]i", CreateMosquitoNR, NULL);
+  env->AddFunction("MosquitoNR", "c[strength]i[restore]i[radius]i[threads]i[exact]b[chroma]b[interlaced]b[mask]c[flat]i[borders]b[dupes]i[temporal]b[cache]s[iterations]i", CreateMosquitoNR, NULL);
   return "Mosquito noise reduction filter";
 }
@@ -31,6 +31,18 @@ class MosquitoNR;
 typedef void (MosquitoNR::* MTFunc)(int thread_id);
 
 const int MAX_THREADS = 32;
+const int MAX_DUPES = 16; // recent frames kept to find duplicates
+const int MAX_ITERATIONS = 4; // passes of smoothing and restoring per frame
+const int LUMA_RING = 64; // rows of a luma ring buffer (power of 2)
+const int SCAN_RING = 256; // rows of the rings of scanned and compared rows (power of 2), a block and its halo for all passes
+const int STRIP_WIDTH = 2048; // frames wider than this are processed in vertical strips
+const int STRIP_HALO = 16; // columns processed again at each inner side of a strip
+const int SKIP_STRIP_WIDTH = 512; // narrower strips when blocks are skipped (mask, flat or temporal), so that parts of a row are skipped too
+const int BLOCK_HALO = 16; // rows above and below a block that its output depends on (flat or unchanged along with it)
+const int BORDER_MARGIN = 16; // samples of the constant borders processed with the picture, they cover what its output depends on
+
+// planes processed by each thread in turn, planar RGB always has its three planes processed
+static const int yuv_planes[3] = { PLANAR_Y, PLANAR_U, PLANAR_V }, rgb_planes[3] = { PLANAR_G, PLANAR_B, PLANAR_R };
 
 struct ThreadInfo
 {
@@ -55,43 +67,111 @@ public:
   void ExecMTFunc(MTFunc mt_func);
 };
 
+// columns left to right and rows top to bottom of a plane that are processed
+struct Rect
+{
+  int left, top, right, bottom;
+};
+
+// per-thread line buffers, a band of the frame is streamed through them block by block
+struct LineBuffers
+{
+  int plane, height; // the plane being processed and its height
+  int field; // the field being processed in interlaced mode, its rows are every other row of the plane
+  int top; // first row of the plane (or field) that is processed, row 0 of the buffers
+  int sub_x, sub_y; // subsampling of the plane, to find its pixels in the mask
+  int left, width; // columns of the plane held in the buffers (the current strip and its halo)
+  int x_from, x_to; // columns of the plane written by the current strip
+  short* work; // temporal buffer (8 rows for shuffling + 8 rows of vertical approximation coefficients + 16 rows of inverse transformed ones)
+  short* luma[2]; // ring buffers of original/blurred luma rows, both are also transformed in place (see ProcessBand)
+  short* bufx[2]; // shuffled horizontal approximation/detail coefficients of vertical approximation coefficients of one block
+  short* blend; // a source row and its blending factors from the mask, or a row scanned for flat blocks
+  short* stage_from; // the plane in the stage buffer read by the current pass, NULL for the source frame
+  short* stage_to; // the plane in the stage buffer written by the current pass, NULL for the output frame
+  int stage_pitch; // pitch of the plane in the stage buffers
+  float row_min[SCAN_RING], row_max[SCAN_RING]; // ring of the minimum and maximum of scanned rows, in units of the source (12 bits for 8-bit)
+  int scanned; // next row to be scanned for flat blocks
+  bool row_same[SCAN_RING]; // ring of the rows that are the same in the previous source
+  int compared; // next row to be compared with the previous source
+};
+
 class MosquitoNR : public GenericVideoFilter
 {
 private:
   bool has_at_least_v8; // passing frame property support
-  const int strength, restore, radius;
+  const int strength, restore, radius, flat, dupes, iterations;
+  const bool exact, chroma, interlaced, borders, temporal;
   int threads;
   const int width, height;
-  const int pitch; // pitch of following buffers
-  short* luma[2]; // original/blurred luma data
-  short* bufy[2]; // vertical approximation/detail coefficients
-  short* bufx[2]; // shuffled horizontal approximation/detail coefficients of vertical approximation coefficients
-  short* work[MAX_THREADS]; // temporal buffer
+  const int strip_width; // planes wider than this are processed in vertical strips
+  int pitch; // pitch of following buffers
+  LineBuffers buf[MAX_THREADS]; // all buffers are carved from one arena, a cache line aligned slice per thread
+  void* arena;
   bool ssse3;
+  int pass; // the pass of the iterations being processed
+  short* stage[2][3]; // 12-bit output of each plane of the passes before the last one, the two buffers are used in turn
+  int stage_pitch[3];
   MTInfo mt;
-  PVideoFrame src, dst;
+  PClip mask; // optional mask clip, 0 keeps the source pixel, 255 takes the filtered one
+  bool initialized; // the buffers are allocated and the threads started, by the first frame filtered
+  PVideoFrame src, dst, mfr;
+  Rect active[3]; // the processed part of each plane of the current frame, inside its constant borders
+  PVideoFrame dup_src[MAX_DUPES], dup_mask[MAX_DUPES], dup_dst[MAX_DUPES]; // recent frames and their output
+  int dup_next; // the oldest of them, replaced next
+  PVideoFrame prev_src, prev_mask, prev_dst; // the previous filtered frame, for temporal
+  HANDLE cache_file, cache_map; // the cache file and its mapping, NULL without a cache
+  size_t cache_slot; // bytes of a frame in the cache file, a multiple of the allocation granularity
 
   void InitBuffer();
   bool AllocBuffer();
   void FreeBuffer();
-  void SmoothingSSSE3(int thread_id);
+  void SmoothingSSSE3(int thread_id, int y_from, int y_to);
+
+  // reflected row index (like 0123.. -> 210123..), rows far below the image are clamped to the first row
+  int ReflectRow(int thread_id, int y) const { const int h = buf[thread_id].height; return y < 0 ? -y : y < h ? y : max(2 * h - 2 - y, 0); }
+  // addresses of rows in the ring buffers
+  short* LumaRow(int thread_id, int k, int y) const { return buf[thread_id].luma[k] + (y & (LUMA_RING - 1)) * pitch + 8; }
+  short* StageRow(int thread_id, short* stage_plane, int y) const { const LineBuffers& b = buf[thread_id]; return stage_plane + (((y + b.top) << interlaced) + b.field) * b.stage_pitch; }
+
+  void CopyLumaFrom(int thread_id, int y_from, int y_to, short* row = NULL);
+  void CopyLumaTo(int thread_id, int k, int y_from, int y_to);
+  void Smoothing(int thread_id, int y_from, int y_to);
+  void DiffLuma(int thread_id, int y_from, int y_to);
+  void WaveletApprox1(int thread_id, int y);
+  void Wavelet2(int thread_id, int y);
+  void WaveletDetail(int thread_id, int y);
+  void InvWaveletHorz(int thread_id, int y);
+  void InvWaveletVert(int thread_id, int y);
+  void InvApproxHorz(int thread_id, int y);
+  void InvApproxVert(int thread_id, int y);
+  void ProcessStrip(int thread_id, int y_start, int y_end);
+  // mask
+  int MaskRow(int thread_id, int y) const { const LineBuffers& b = buf[thread_id]; return (((y + b.top) << interlaced) + b.field) << b.sub_y; }
+  bool MaskedOut(int thread_id, int y_from, int y_to) const;
+  void ApplyMask(int thread_id, int k, int y_from, int y_to);
+  // skipped blocks
+  void CopyRows(int thread_id, int y_from, int y_to, const PVideoFrame& from);
+  bool Flat(int thread_id, int y_from, int y_to);
+  bool Unchanged(int thread_id, int y_from, int y_to);
+  const PVideoFrame* SkipBlock(int thread_id, int y);
+  // borders
+  Rect FindActive(int plane, const Rect& full) const;
+  void CopyBorders(int thread_id, int plane, const Rect& r);
+  // duplicates
+  bool SameFrame(const PVideoFrame& a, const PVideoFrame& b, const VideoInfo& fvi) const;
+  // cache file (cache.cpp)
+  bool OpenCache(const char* path);
+  void CloseCache();
+  uint64_t SourceHash() const;
+  bool ReadCache(int n, uint64_t hash);
+  void WriteCache(int n, uint64_t hash);
 
 public:
-  MosquitoNR(PClip _child, int _strength, int _restore, int _radius, int _threads, IScriptEnvironment* env);
+  MosquitoNR(PClip _child, int _strength, int _restore, int _radius, int _threads, bool _exact, bool _chroma, bool _interlaced, PClip _mask, int _flat, bool _borders, int _dupes, bool _temporal, const char* _cache, int _iterations, IScriptEnvironment* env);
   ~MosquitoNR();
   PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env);
 
-  void CopyLumaFrom();
-  void CopyLumaTo();
-  void Smoothing(int thread_id);
-  void WaveletVert1(int thread_id);
-  void WaveletHorz1(int thread_id);
-  void WaveletVert2(int thread_id);
-  void WaveletHorz2(int thread_id);
-  void WaveletHorz3(int thread_id);
-  void BlendCoef(int thread_id);
-  void InvWaveletHorz(int thread_id);
-  void InvWaveletVert(int thread_id);
+  void ProcessBand(int thread_id);
 };
 
 #endif // MOSQUITO_NR_H_
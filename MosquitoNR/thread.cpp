@@ -47,6 +47,7 @@ MTInfo::~MTInfo()
   }
 }
 
+// threads are created once, a call after a partial failure fails too
 bool MTInfo::CreateThreads(int _threads, MosquitoNR* inst)
 {
   if (threads || _threads <= 0 || _threads > MAX_THREADS) return false;
@@ -26,40 +26,44 @@
 #include <emmintrin.h>
 #include <tmmintrin.h>
 
-void MosquitoNR::WaveletVert1(int thread_id)
+void MosquitoNR::WaveletApprox1(int thread_id, int y)
 {
-  const int y_start = (height + 7) / 8 * thread_id / threads * 8;
-  const int y_end = (height + 7) / 8 * (thread_id + 1) / threads * 8;
-  if (y_start == y_end) return;
-  const int width = this->width;
+  const int width = buf[thread_id].width;
   const int pitch = this->pitch;
+  const int height = buf[thread_id].height;
+  const int vloop = ((height + 7) & ~7) / 2; // rows of vertical approximation coefficients
   const int hloop = (width + 7) / 8;
+  const int hloop1 = (width + 4 + 2 + 3) / 4;
+  const int hloop2 = (width + 3) / 4;
+  short* work = buf[thread_id].work;
+  short* strip = work + 8 * pitch; // 8 rows of vertical approximation coefficients
+
+  const int eax = pitch * sizeof(short);
+  __m128i xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7;
+  uint8_t *esi, *edi, *edx;
 
-  for (int y = y_start; y < y_end; y += 8)
+  // vertical transform, detail coefficients are not stored
+  for (int r = 0; r < 8 && y + r < vloop; r += 4)
   {
-    short* srcp = luma[0] + y * pitch + 8;
-    short* dstp = bufy[0] + y / 2 * pitch + 8;
+    short* srcp[11]; // rows -2 to 8, reflected at the top and bottom edges
+    short* dstp = strip + r * pitch + 8;
+    for (int i = 0; i < 11; ++i)
+      srcp[i] = LumaRow(thread_id, 0, ReflectRow(thread_id, (y + r) * 2 - 2 + i));
 
-    uint8_t* esi = (uint8_t*)srcp;
-    uint8_t* edi = (uint8_t*)dstp;
-    const int eax = pitch * sizeof(short);
+    edi = (uint8_t*)dstp;
 
-    __m128i xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7;
-    for (int horiz = 0; horiz < hloop; horiz++) {
-      auto tmp_esi = esi;
-      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi));
-      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + eax));
-      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 2 * eax));
+    for (int horiz = 0, x = 0; horiz < hloop; horiz++, x += 8) {
+      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[0] + x));
+      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[1] + x));
+      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[2] + x));
       xmm2 = _mm_add_epi16(xmm2, xmm1);
       xmm2 = _mm_srai_epi16(xmm2, 1);
       xmm0 = _mm_sub_epi16(xmm0, xmm2);
 
-      esi = esi + 3 * eax;
-
-      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi));
-      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + eax));
-      xmm4 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 2 * eax));
-      xmm5 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 3 * eax));
+      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[3] + x));
+      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[4] + x));
+      xmm4 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[5] + x));
+      xmm5 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[6] + x));
       xmm6 = xmm1;
       xmm7 = xmm3;
       xmm1 = _mm_add_epi16(xmm1, xmm3);
@@ -77,12 +81,10 @@ void MosquitoNR::WaveletVert1(int thread_id)
       _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm6);
       _mm_store_si128(reinterpret_cast<__m128i*>(edi + eax), xmm7);
 
-      esi = esi + 4 * eax;
-
-      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi));
-      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + eax));
-      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 2 * eax));
-      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 3 * eax));
+      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[7] + x));
+      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[8] + x));
+      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[9] + x));
+      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[10] + x));
       xmm6 = xmm5;
       xmm7 = xmm1;
       xmm5 = _mm_add_epi16(xmm5, xmm1);
@@ -100,10 +102,7 @@ void MosquitoNR::WaveletVert1(int thread_id)
       _mm_store_si128(reinterpret_cast<__m128i*>(edi + 2 * eax), xmm6);
       _mm_store_si128(reinterpret_cast<__m128i*>(edi + 3 * eax), xmm7);
 
-      esi = tmp_esi;
-      esi += 16;
       edi += 16;
-
     }
 
     // horizontal reflection
@@ -111,202 +110,163 @@ void MosquitoNR::WaveletVert1(int thread_id)
     for (int i = 0; i < 4; ++i, p += pitch)
       p[-2] = p[2], p[-1] = p[1], p[width] = p[width - 2], p[width + 1] = p[width - 3];
   }
-}
-
-void MosquitoNR::WaveletHorz1(int thread_id)
-{
-  const int y_start = (height + 15) / 16 * thread_id / threads * 8;
-  const int y_end = (height + 15) / 16 * (thread_id + 1) / threads * 8;
-  if (y_start == y_end) return;
-  const int width = this->width;
-  const int pitch = this->pitch;
-  const int hloop1 = (width + 4 + 2 + 3) / 4;
-  const int hloop2 = (width + 3) / 4;
-  short* work = this->work[thread_id];
 
-  for (int y = y_start; y < y_end; y += 8)
-  {
-    short* srcp = bufy[0] + y * pitch + 4;
-    short* dstp = luma[0] + y / 2 * pitch + 8;
-
-    // shuffle
-    uint8_t* esi = (uint8_t*)srcp;
-    uint8_t* edi = (uint8_t*)work;
-    const int eax = pitch * sizeof(short);
-    uint8_t* edx = esi + 4 * eax; // edx = srcp + 4 * pitch
-
-    __m128i xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7;
-    for (int horiz = 0; horiz < hloop1; horiz++) {
+  // horizontal transform
+  short* srcp = strip + 4;
+  short* dstp = buf[thread_id].bufx[0] + 8;
+
+  // shuffle
+  esi = (uint8_t*)srcp;
+  edi = (uint8_t*)work;
+  edx = esi + 4 * eax; // edx = srcp + 4 * pitch
+
+  for (int horiz = 0; horiz < hloop1; horiz++) {
+
+    xmm0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(esi)); // ] // 03, 02, 01, 00
+    xmm1 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(esi + eax)); // 13, 12, 11, 10
+    xmm2 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(esi + 2 * eax)); // 23, 22, 21, 20
+    xmm3 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(esi + 3 * eax)); // 33, 32, 31, 30
+    xmm4 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(edx)); // 43, 42, 41, 40
+    xmm5 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(edx + eax)); // 53, 52, 51, 50
+    xmm6 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(edx + 2 * eax)); // 63, 62, 61, 60
+    xmm7 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(edx + 3 * eax)); // 73, 72, 71, 70
+    xmm0 = _mm_unpacklo_epi16(xmm0, xmm1); // 13, 03, 12, 02, 11, 01, 10, 00
+    xmm2 = _mm_unpacklo_epi16(xmm2, xmm3); // 33, 23, 32, 22, 31, 21, 30, 20
+    xmm4 = _mm_unpacklo_epi16(xmm4, xmm5); // 53, 43, 52, 42, 51, 41, 50, 40
+    xmm6 = _mm_unpacklo_epi16(xmm6, xmm7); // 73, 63, 72, 62, 71, 61, 70, 60
+    xmm1 = xmm0;
+    xmm5 = xmm4;
+    xmm0 = _mm_unpacklo_epi32(xmm0, xmm2); // 31, 21, 11, 01, 30, 20, 10, 00
+    xmm1 = _mm_unpackhi_epi32(xmm1, xmm2); // 33, 23, 13, 03, 32, 22, 12, 02
+    xmm4 = _mm_unpacklo_epi32(xmm4, xmm6); // 71, 61, 51, 41, 70, 60, 50, 40
+    xmm5 = _mm_unpackhi_epi32(xmm5, xmm6); // 73, 63, 53, 43, 72, 62, 52, 42
+    xmm2 = xmm0;
+    xmm3 = xmm1;
+    xmm0 = _mm_unpacklo_epi64(xmm0, xmm4); // 70, 60, 50, 40, 30, 20, 10, 00
+    xmm2 = _mm_unpackhi_epi64(xmm2, xmm4); // 71, 61, 51, 41, 31, 21, 11, 01
+    xmm1 = _mm_unpacklo_epi64(xmm1, xmm5); // 72, 62, 52, 42, 32, 22, 12, 02
+    xmm3 = _mm_unpackhi_epi64(xmm3, xmm5); // 73, 63, 53, 43, 33, 23, 13, 03
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm0);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + 16), xmm2);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + 32), xmm1);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + 48), xmm3);
+    esi += 8;
+    edx += 8;
+    edi += 64;
+  }
 
-      xmm0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(esi)); // ] // 03, 02, 01, 00
-      xmm1 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(esi + eax)); // 13, 12, 11, 10
-      xmm2 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(esi + 2 * eax)); // 23, 22, 21, 20
-      xmm3 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(esi + 3 * eax)); // 33, 32, 31, 30
-      xmm4 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(edx)); // 43, 42, 41, 40
-      xmm5 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(edx + eax)); // 53, 52, 51, 50
-      xmm6 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(edx + 2 * eax)); // 63, 62, 61, 60
-      xmm7 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(edx + 3 * eax)); // 73, 72, 71, 70
-      xmm0 = _mm_unpacklo_epi16(xmm0, xmm1); // 13, 03, 12, 02, 11, 01, 10, 00
-      xmm2 = _mm_unpacklo_epi16(xmm2, xmm3); // 33, 23, 32, 22, 31, 21, 30, 20
-      xmm4 = _mm_unpacklo_epi16(xmm4, xmm5); // 53, 43, 52, 42, 51, 41, 50, 40
-      xmm6 = _mm_unpacklo_epi16(xmm6, xmm7); // 73, 63, 72, 62, 71, 61, 70, 60
-      xmm1 = xmm0;
-      xmm5 = xmm4;
-      xmm0 = _mm_unpacklo_epi32(xmm0, xmm2); // 31, 21, 11, 01, 30, 20, 10, 00
-      xmm1 = _mm_unpackhi_epi32(xmm1, xmm2); // 33, 23, 13, 03, 32, 22, 12, 02
-      xmm4 = _mm_unpacklo_epi32(xmm4, xmm6); // 71, 61, 51, 41, 70, 60, 50, 40
-      xmm5 = _mm_unpackhi_epi32(xmm5, xmm6); // 73, 63, 53, 43, 72, 62, 52, 42
-      xmm2 = xmm0;
-      xmm3 = xmm1;
-      xmm0 = _mm_unpacklo_epi64(xmm0, xmm4); // 70, 60, 50, 40, 30, 20, 10, 00
-      xmm2 = _mm_unpackhi_epi64(xmm2, xmm4); // 71, 61, 51, 41, 31, 21, 11, 01
-      xmm1 = _mm_unpacklo_epi64(xmm1, xmm5); // 72, 62, 52, 42, 32, 22, 12, 02
-      xmm3 = _mm_unpackhi_epi64(xmm3, xmm5); // 73, 63, 53, 43, 33, 23, 13, 03
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm0);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi + 16), xmm2);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi + 32), xmm1);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi + 48), xmm3);
-      esi += 8;
-      edx += 8;
-      edi += 64;
-    }
+  // wavelet transform
+  esi = (uint8_t*)work;
+  edi = (uint8_t*)dstp;
+  esi += 64; // esi = work + 32 (short*)
+
+  xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi - 32));
+  xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi - 16));
+  xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi));
+  xmm2 = _mm_add_epi16(xmm2, xmm1);
+  xmm2 = _mm_srai_epi16(xmm2, 1);
+  xmm0 = _mm_sub_epi16(xmm0, xmm2);
+
+  // wavelet_next4columns:
+  for (int horiz = 0; horiz < hloop2; horiz++) {
+    xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 16));
+    xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 32));
+    xmm4 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 48));
+    xmm5 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 64));
+    xmm6 = xmm1;
+    xmm7 = xmm3;
+    xmm1 = _mm_add_epi16(xmm1, xmm3);
+    xmm3 = _mm_add_epi16(xmm3, xmm5);
+    xmm1 = _mm_srai_epi16(xmm1, 1);
+    xmm3 = _mm_srai_epi16(xmm3, 1);
+    xmm2 = _mm_sub_epi16(xmm2, xmm1);
+    xmm4 = _mm_sub_epi16(xmm4, xmm3);
+    xmm0 = _mm_add_epi16(xmm0, xmm2);
+    xmm2 = _mm_add_epi16(xmm2, xmm4);
+    xmm0 = _mm_srai_epi16(xmm0, 2);
+    xmm2 = _mm_srai_epi16(xmm2, 2);
+    xmm6 = _mm_add_epi16(xmm6, xmm0);
+    xmm7 = _mm_add_epi16(xmm7, xmm2);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm6);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + 16), xmm7);
+    xmm0 = xmm4;
+    xmm1 = xmm5;
+    esi += 64;
+    edi += 32;
+    edx += 32;
+  }
 
-    // wavelet transform
-    esi = (uint8_t*)work;
+  // horizontal reflection
+  if (width % 2 == 0) {
     edi = (uint8_t*)dstp;
-    esi += 64; // esi = work + 32 (short*)
-
-    xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi - 32));
-    xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi - 16));
-    xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi));
-    xmm2 = _mm_add_epi16(xmm2, xmm1);
-    xmm2 = _mm_srai_epi16(xmm2, 1);
-    xmm0 = _mm_sub_epi16(xmm0, xmm2);
-
-    // wavelet_next4columns:
-    for (int horiz = 0; horiz < hloop2; horiz++) {
-      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 16));
-      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 32));
-      xmm4 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 48));
-      xmm5 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 64));
-      xmm6 = xmm1;
-      xmm7 = xmm3;
-      xmm1 = _mm_add_epi16(xmm1, xmm3);
-      xmm3 = _mm_add_epi16(xmm3, xmm5);
-      xmm1 = _mm_srai_epi16(xmm1, 1);
-      xmm3 = _mm_srai_epi16(xmm3, 1);
-      xmm2 = _mm_sub_epi16(xmm2, xmm1);
-      xmm4 = _mm_sub_epi16(xmm4, xmm3);
-      xmm0 = _mm_add_epi16(xmm0, xmm2);
-      xmm2 = _mm_add_epi16(xmm2, xmm4);
-      xmm0 = _mm_srai_epi16(xmm0, 2);
-      xmm2 = _mm_srai_epi16(xmm2, 2);
-      xmm6 = _mm_add_epi16(xmm6, xmm0);
-      xmm7 = _mm_add_epi16(xmm7, xmm2);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm6);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi + 16), xmm7);
-      xmm0 = xmm4;
-      xmm1 = xmm5;
-      esi += 64;
-      edi += 32;
-      edx += 32;
-    }
-
-    // horizontal reflection
-    if (width % 2 == 0) {
-      edi = (uint8_t*)dstp;
-      const int eax = width << 3; // eax = width / 2 * 16
-      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(edi + eax - 16));
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi + eax), xmm0);
-    }
+    const int eax = width << 3; // eax = width / 2 * 16
+    xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(edi + eax - 16));
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + eax), xmm0);
   }
 }
 
-void MosquitoNR::WaveletVert2(int thread_id)
+void MosquitoNR::Wavelet2(int thread_id, int y)
 {
-  const int y_start = (height + 7) / 8 * thread_id / threads * 8;
-  const int y_end = (height + 7) / 8 * (thread_id + 1) / threads * 8;
-  if (y_start == y_end) return;
-  const int width = this->width;
+  const int width = buf[thread_id].width;
   const int pitch = this->pitch;
+  const int height = buf[thread_id].height;
+  const int vloop = ((height + 7) & ~7) / 2; // rows of vertical approximation coefficients
   const int hloop = (width + 7) / 8;
+  const int hloop1 = (width + 4 + 2 + 3) / 4;
+  const int hloop2 = restore == 128 ? (width + 7) / 8 : (width + 3) / 4;
+  const int multiplier = ((128 - restore) << 16) + restore;
+  short* work = buf[thread_id].work;
+  short* strip = work + 8 * pitch; // 8 rows of vertical approximation coefficients
 
-  for (int y = y_start; y < y_end; y += 8)
-  {
-    short* srcp = luma[1] + y * pitch + 8;
-    short* dstp1 = bufy[0] + y / 2 * pitch + 8;
-    short* dstp2 = bufy[1] + (y / 2 + 1) * pitch + 8;
-
-    uint8_t* esi = (uint8_t*)srcp;
-    uint8_t* edi = (uint8_t*)dstp1;
-    uint8_t* edx = (uint8_t*)dstp2;
-    const int eax = pitch * sizeof(short);
+  const int eax = pitch * sizeof(short);
+  __m128i xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7;
+  uint8_t *esi, *edi, *edx;
 
+  // vertical transform, lifting in place
+  for (int r = 0; r < 8 && y + r < vloop; r += 4)
+  {
+    // detail coefficients replace the odd rows inside the image
+    for (int i = y + r; i < y + r + 4 && i * 2 + 1 < height; ++i)
+      WaveletDetail(thread_id, i);
+
+    short* srcp1[4]; // even rows 0 to 6, reflected at the bottom edge
+    short* srcp2[5]; // detail coefficients in odd rows -1 to 7, reflected at the top and bottom edges
+    short* dstp1 = strip + r * pitch + 8;
+    for (int i = 0; i < 4; ++i)
+      srcp1[i] = LumaRow(thread_id, 1, ReflectRow(thread_id, (y + r + i) * 2));
+    for (int i = 0; i < 5; ++i)
+      srcp2[i] = LumaRow(thread_id, 1, ReflectRow(thread_id, (y + r + i) * 2 - 1));
 
-    //next8columns:
-    __m128i xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7;
-    for (int horiz = 0; horiz < hloop; horiz++) {
-      auto tmp_esi = esi;
-      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi));
-      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + eax));
-      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 2 * eax));
-      xmm2 = _mm_add_epi16(xmm2, xmm1);
-      xmm2 = _mm_srai_epi16(xmm2, 1);
-      xmm0 = _mm_sub_epi16(xmm0, xmm2);
-      esi += 3 * eax;
+    edi = (uint8_t*)dstp1;
 
-      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi));
-      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + eax));
-      xmm4 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 2 * eax));
-      xmm5 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 3 * eax));
-      xmm6 = xmm1;
-      xmm7 = xmm3;
-      xmm1 = _mm_add_epi16(xmm1, xmm3);
-      xmm3 = _mm_add_epi16(xmm3, xmm5);
-      xmm1 = _mm_srai_epi16(xmm1, 1);
-      xmm3 = _mm_srai_epi16(xmm3, 1);
-      xmm2 = _mm_sub_epi16(xmm2, xmm1);
-      xmm4 = _mm_sub_epi16(xmm4, xmm3);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edx), xmm2);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edx + eax), xmm4);
-      xmm0 = _mm_add_epi16(xmm0, xmm2);
-      xmm2 = _mm_add_epi16(xmm2, xmm4);
+    for (int horiz = 0, x = 0; horiz < hloop; horiz++, x += 8) {
+      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp2[0] + x));
+      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp2[1] + x));
+      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp2[2] + x));
+      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp2[3] + x));
+      xmm4 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp2[4] + x));
+      xmm0 = _mm_add_epi16(xmm0, xmm1);
+      xmm1 = _mm_add_epi16(xmm1, xmm2);
+      xmm2 = _mm_add_epi16(xmm2, xmm3);
+      xmm3 = _mm_add_epi16(xmm3, xmm4);
       xmm0 = _mm_srai_epi16(xmm0, 2);
+      xmm1 = _mm_srai_epi16(xmm1, 2);
       xmm2 = _mm_srai_epi16(xmm2, 2);
-      xmm6 = _mm_add_epi16(xmm6, xmm0);
-      xmm7 = _mm_add_epi16(xmm7, xmm2);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm6);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi + eax), xmm7);
-
-      esi += 4 * eax; // lea esi, [esi + 4 * eax]
-
-      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi));
-      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + eax));
-      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 2 * eax));
-      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 3 * eax));
-      xmm6 = xmm5;
-      xmm7 = xmm1;
-      xmm5 = _mm_add_epi16(xmm5, xmm1);
-      xmm1 = _mm_add_epi16(xmm1, xmm3);
-      xmm5 = _mm_srai_epi16(xmm5, 1);
-      xmm1 = _mm_srai_epi16(xmm1, 1);
-      xmm0 = _mm_sub_epi16(xmm0, xmm5);
-      xmm2 = _mm_sub_epi16(xmm2, xmm1);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edx + 2 * eax), xmm0);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edx + 3 * eax), xmm2);
+      xmm3 = _mm_srai_epi16(xmm3, 2);
+      xmm4 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp1[0] + x));
+      xmm5 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp1[1] + x));
+      xmm6 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp1[2] + x));
+      xmm7 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp1[3] + x));
       xmm4 = _mm_add_epi16(xmm4, xmm0);
-      xmm0 = _mm_add_epi16(xmm0, xmm2);
-      xmm4 = _mm_srai_epi16(xmm4, 2);
-      xmm0 = _mm_srai_epi16(xmm0, 2);
-      xmm6 = _mm_add_epi16(xmm6, xmm4);
-      xmm7 = _mm_add_epi16(xmm7, xmm0);
+      xmm5 = _mm_add_epi16(xmm5, xmm1);
+      xmm6 = _mm_add_epi16(xmm6, xmm2);
+      xmm7 = _mm_add_epi16(xmm7, xmm3);
+      _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm4);
+      _mm_store_si128(reinterpret_cast<__m128i*>(edi + eax), xmm5);
       _mm_store_si128(reinterpret_cast<__m128i*>(edi + 2 * eax), xmm6);
       _mm_store_si128(reinterpret_cast<__m128i*>(edi + 3 * eax), xmm7);
 
-      esi = tmp_esi;
-      esi += 16;
       edi += 16;
-      edx += 16;
     }
 
     // horizontal reflection
@@ -315,36 +275,17 @@ void MosquitoNR::WaveletVert2(int thread_id)
       p[-2] = p[2], p[-1] = p[1], p[width] = p[width - 2], p[width + 1] = p[width - 3];
   }
 
-  // vertical reflection
-  if (y_start == 0)
-    memcpy(bufy[1], bufy[1] + pitch, pitch * sizeof(short));
-  if (thread_id == threads - 1 && height % 2 == 0)
-    memcpy(bufy[1] + (height / 2 + 1) * pitch, bufy[1] + (height / 2 - 1) * pitch, pitch * sizeof(short));
-}
-
-void MosquitoNR::WaveletHorz2(int thread_id)
-{
-  const int y_start = (height + 15) / 16 * thread_id / threads * 8;
-  const int y_end = (height + 15) / 16 * (thread_id + 1) / threads * 8;
-  if (y_start == y_end) return;
-  const int width = this->width;
-  const int pitch = this->pitch;
-  const int hloop1 = (width + 4 + 2 + 3) / 4;
-  const int hloop2 = (width + 7) / 8;
-  short* work = this->work[thread_id];
+  // horizontal transform
+  short* srcp = strip + 4;
 
-  for (int y = y_start; y < y_end; y += 8)
-  {
-    short* srcp = bufy[0] + y * pitch + 4;
-    short* dstp = bufx[1] + y / 2 * pitch + 8;
+  if (restore == 128) { // detail coefficients only
+    short* dstp = buf[thread_id].bufx[1] + 8;
 
     // shuffle
-    uint8_t* esi = (uint8_t*)srcp;
-    uint8_t* edi = (uint8_t*)work;
-    const int eax = pitch * sizeof(short);
-    uint8_t* edx = esi + eax * 4; // edx = srcp + 4 * pitch
+    esi = (uint8_t*)srcp;
+    edi = (uint8_t*)work;
+    edx = esi + eax * 4; // edx = srcp + 4 * pitch
 
-    __m128i xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7;
     // shuffle_next4columns:
     for (int horiz = 0; horiz < hloop1; horiz++) {
       xmm0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(esi)); // 03, 02, 01, 00
@@ -380,7 +321,7 @@ void MosquitoNR::WaveletHorz2(int thread_id)
       edi += 64;
     }
 
-      // wavelet transform
+    // wavelet transform
     esi = (uint8_t*)work;
     edi = (uint8_t*)dstp;
     esi += 64; // esi = work + 32 (short *)
@@ -433,32 +374,15 @@ void MosquitoNR::WaveletHorz2(int thread_id)
       _mm_store_si128(reinterpret_cast<__m128i*>(edi + eax), xmm0);
     }
   }
-}
-
-void MosquitoNR::WaveletHorz3(int thread_id)
-{
-  const int y_start = (height + 15) / 16 * thread_id / threads * 8;
-  const int y_end = (height + 15) / 16 * (thread_id + 1) / threads * 8;
-  if (y_start == y_end) return;
-  const int width = this->width;
-  const int pitch = this->pitch;
-  const int hloop1 = (width + 4 + 2 + 3) / 4;
-  const int hloop2 = (width + 3) / 4;
-  short* work = this->work[thread_id];
-
-  for (int y = y_start; y < y_end; y += 8)
-  {
-    short* srcp = bufy[0] + y * pitch + 4;
-    short* dstp1 = bufx[0] + y / 2 * pitch + 8;
-    short* dstp2 = bufx[1] + y / 2 * pitch + 8;
+  else {
+    short* dstp1 = strip; // approximation coefficients are blended into bufx[0]
+    short* dstp2 = buf[thread_id].bufx[1] + 8;
 
     // shuffle
-    uint8_t* esi = (uint8_t*)srcp;
-    uint8_t* edi = (uint8_t*)work;
-    const int eax = pitch * sizeof(short);
-    uint8_t* edx = esi + 4 * eax; // edx = srcp + 4 * pitch
+    esi = (uint8_t*)srcp;
+    edi = (uint8_t*)work;
+    edx = esi + 4 * eax; // edx = srcp + 4 * pitch
 
-    __m128i xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7;
     // shuffle_next4columns:
     for (int horiz = 0; horiz < hloop1; horiz++) {
       xmm0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(esi)); // 03, 02, 01, 00
@@ -549,198 +473,241 @@ void MosquitoNR::WaveletHorz3(int thread_id)
       _mm_store_si128(reinterpret_cast<__m128i*>(edi + eax), xmm0);
       _mm_store_si128(reinterpret_cast<__m128i*>(edx + eax), xmm1);
     }
+
+    // blend
+    esi = (uint8_t*)strip;
+    edi = (uint8_t*)(buf[thread_id].bufx[0] + 8);
+
+    xmm6 = _mm_set1_epi32(multiplier); // xmm6 = [128 - restore, restore] * 4
+    xmm7 = _mm_set1_epi32(64); // xmm7 = [64] * 4
+
+    for (int horiz = 0; horiz < hloop2 * 2 + 1; horiz++) {
+      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(edi)); // d7, d6, d5, d4, d3, d2, d1, d0
+      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi)); // s7, s6, s5, s4, s3, s2, s1, s0
+      xmm1 = xmm0;
+      xmm0 = _mm_unpacklo_epi16(xmm0, xmm2); // s3, d3, s2, d2, s1, d1, s0, d0
+      xmm1 = _mm_unpackhi_epi16(xmm1, xmm2); // s7, d7, s6, d6, s5, d5, s4, d4
+      xmm0 = _mm_madd_epi16(xmm0, xmm6);
+      xmm1 = _mm_madd_epi16(xmm1, xmm6);
+      xmm0 = _mm_add_epi32(xmm0, xmm7);
+      xmm1 = _mm_add_epi32(xmm1, xmm7);
+      xmm0 = _mm_srai_epi32(xmm0, 7);
+      xmm1 = _mm_srai_epi32(xmm1, 7);
+      xmm0 = _mm_packs_epi32(xmm0, xmm1);
+      _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm0);
+      edi += 16;
+      esi += 16;
+    }
   }
 }
 
-void MosquitoNR::BlendCoef(int thread_id)
+// vertical detail coefficients of row 2 * y + 1 of luma[1], stored in place
+void MosquitoNR::WaveletDetail(int thread_id, int y)
 {
-  const int y_start = ((height + 15) & ~15) / 4 * thread_id / threads;
-  const int y_end = ((height + 15) & ~15) / 4 * (thread_id + 1) / threads;
-  if (y_start == y_end) return;
-  const int pitch = this->pitch;
-  const int multiplier = ((128 - restore) << 16) + restore;
-  short* dstp = luma[0];
-  short* srcp = bufx[0];
+  const int hloop = (buf[thread_id].width + 7) / 8;
+  short* srcp0 = LumaRow(thread_id, 1, y * 2);
+  short* srcp2 = LumaRow(thread_id, 1, ReflectRow(thread_id, y * 2 + 2));
+  short* dstp = LumaRow(thread_id, 1, y * 2 + 1);
+
+  __m128i xmm0, xmm1, xmm2;
+
+  for (int horiz = 0, x = 0; horiz < hloop; horiz++, x += 8) {
+    xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp0 + x));
+    xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(dstp + x));
+    xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp2 + x));
+    xmm0 = _mm_add_epi16(xmm0, xmm2);
+    xmm0 = _mm_srai_epi16(xmm0, 1);
+    xmm1 = _mm_sub_epi16(xmm1, xmm0);
+    _mm_store_si128(reinterpret_cast<__m128i*>(dstp + x), xmm1);
+  }
+}
 
-  const int eax = pitch * sizeof(short);
+// luma[0] = (luma[0] - luma[1]) * restore / 128
+void MosquitoNR::DiffLuma(int thread_id, int y_from, int y_to)
+{
+  const int width = buf[thread_id].width;
+  const int hloop = (width + 7) / 8;
+  const int multiplier = -restore * 65536 + restore;
 
   __m128i xmm0, xmm1, xmm2, xmm6, xmm7;
 
-  uint8_t* edi = (uint8_t*)(dstp + y_start * pitch);
-  uint8_t* esi = (uint8_t*)(srcp + y_start * pitch);
-  int ecx = (y_end - y_start) * pitch / 8;
+  xmm6 = _mm_set1_epi32(multiplier); // xmm6 = [-restore, restore] * 4
+  xmm7 = _mm_set1_epi32(64); // xmm7 = [64] * 4
 
-  xmm6 = _mm_set1_epi32(multiplier); // xmm6 = [128 - restore, restore] * 4
+  for (int y = y_from; y < y_to; ++y)
+  {
+    short* dstp = LumaRow(thread_id, 0, y);
+    short* srcp = LumaRow(thread_id, 1, y);
 
-  xmm7 = _mm_set1_epi32(64); // xmm7 = [64] * 4
+    uint8_t* edi = (uint8_t*)dstp;
+    uint8_t* esi = (uint8_t*)srcp;
 
-//  next8pixels:
-  for (int horiz = 0; horiz < ecx; horiz++) {
-    xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(edi)); // d7, d6, d5, d4, d3, d2, d1, d0
-    xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi)); // s7, s6, s5, s4, s3, s2, s1, s0
-    xmm1 = xmm0;
-    xmm0 = _mm_unpacklo_epi16(xmm0, xmm2); // s3, d3, s2, d2, s1, d1, s0, d0
-    xmm1 = _mm_unpackhi_epi16(xmm1, xmm2); // s7, d7, s6, d6, s5, d5, s4, d4
-    xmm0 = _mm_madd_epi16(xmm0, xmm6);
-    xmm1 = _mm_madd_epi16(xmm1, xmm6);
-    xmm0 = _mm_add_epi32(xmm0, xmm7);
-    xmm1 = _mm_add_epi32(xmm1, xmm7);
-    xmm0 = _mm_srai_epi32(xmm0, 7);
-    xmm1 = _mm_srai_epi32(xmm1, 7);
-    xmm0 = _mm_packs_epi32(xmm0, xmm1);
-    _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm0);
-    edi += 16;
-    esi += 16;
+    for (int horiz = 0; horiz < hloop; horiz++) {
+      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(edi)); // d7, d6, d5, d4, d3, d2, d1, d0
+      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi)); // s7, s6, s5, s4, s3, s2, s1, s0
+      xmm1 = xmm0;
+      xmm0 = _mm_unpacklo_epi16(xmm0, xmm2); // s3, d3, s2, d2, s1, d1, s0, d0
+      xmm1 = _mm_unpackhi_epi16(xmm1, xmm2); // s7, d7, s6, d6, s5, d5, s4, d4
+      xmm0 = _mm_madd_epi16(xmm0, xmm6);
+      xmm1 = _mm_madd_epi16(xmm1, xmm6);
+      xmm0 = _mm_add_epi32(xmm0, xmm7);
+      xmm1 = _mm_add_epi32(xmm1, xmm7);
+      xmm0 = _mm_srai_epi32(xmm0, 7);
+      xmm1 = _mm_srai_epi32(xmm1, 7);
+      xmm0 = _mm_packs_epi32(xmm0, xmm1);
+      _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm0);
+      edi += 16;
+      esi += 16;
+    }
+
+    // horizontal reflection
+    short* p = dstp;
+    p[-2] = p[2], p[-1] = p[1], p[width] = p[width - 2], p[width + 1] = p[width - 3];
   }
 }
 
-void MosquitoNR::InvWaveletHorz(int thread_id)
+// horizontal inverse transform of a block into the ring buffer of vertical approximation coefficients
+void MosquitoNR::InvWaveletHorz(int thread_id, int y)
 {
-  const int y_start = (height + 15) / 16 * thread_id / threads * 8;
-  const int y_end = (height + 15) / 16 * (thread_id + 1) / threads * 8;
-  if (y_start == y_end) return;
-  const int width = this->width;
+  const int width = buf[thread_id].width;
   const int pitch = this->pitch;
-  const int hloop = (width + 3) / 4;
-  short* work = this->work[thread_id];
+  const int hloop1 = (width + 3) / 4;
+  short* work = buf[thread_id].work;
+  short* ring = work + 16 * pitch; // 2 blocks of vertical approximation coefficients
 
-  for (int y = y_start; y < y_end; y += 8)
-  {
-    short* srcp1 = luma[0] + y / 2 * pitch + 8;
-    short* srcp2 = bufx[1] + y / 2 * pitch + 8;
-    short* dstp = bufy[0] + y * pitch + 8;
-
-    __m128i xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7;
-
-    // wavelet transform
-    uint8_t* esi = (uint8_t*)srcp1;
-    uint8_t* edx = (uint8_t*)srcp2;
-    uint8_t* edi = (uint8_t*)work;
-
-    xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx - 16));
-    xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi));
-    xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx));
-    xmm2 = _mm_add_epi16(xmm2, xmm1);
-    xmm2 = _mm_srai_epi16(xmm2, 2);
-    xmm0 = _mm_sub_epi16(xmm0, xmm2);
-    _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm0);
-
-    //wavelet_next4columns:
-    for (int horiz = 0; horiz < hloop; horiz++) {
-      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 16));
-      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx + 16));
-      xmm4 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 32));
-      xmm5 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx + 32));
-      xmm6 = xmm1;
-      xmm7 = xmm3;
-      xmm1 = _mm_add_epi16(xmm1, xmm3);
-      xmm3 = _mm_add_epi16(xmm3, xmm5);
-      xmm1 = _mm_srai_epi16(xmm1, 2);
-      xmm3 = _mm_srai_epi16(xmm3, 2);
-      xmm2 = _mm_sub_epi16(xmm2, xmm1);
-      xmm4 = _mm_sub_epi16(xmm4, xmm3);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi + 32), xmm2);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi + 64), xmm4);
-      xmm0 = _mm_add_epi16(xmm0, xmm2);
-      xmm2 = _mm_add_epi16(xmm2, xmm4);
-      xmm0 = _mm_srai_epi16(xmm0, 1);
-      xmm2 = _mm_srai_epi16(xmm2, 1);
-      xmm6 = _mm_add_epi16(xmm6, xmm0);
-      xmm7 = _mm_add_epi16(xmm7, xmm2);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi + 16), xmm6);
-      _mm_store_si128(reinterpret_cast<__m128i*>(edi + 48), xmm7);
-      xmm0 = xmm4;
-      xmm1 = xmm5;
-      esi += 32;
-      edx += 32;
-      edi += 64;
-    }
-
-    // shuffle
-    esi = (uint8_t*)work;
-    edi = (uint8_t*)dstp;
-    const int eax = pitch * sizeof(short); // eax = pitch * sizeof(short)
-    edx = edi + 4 * eax; // edx = dstp + 4 * pitch
+  __m128i xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7;
 
-    // shuffle_next4columns:
-    for (int horiz = 0; horiz < hloop; horiz++) {
-      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi)); // 70, 60, 50, 40, 30, 20, 10, 00
-      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 16)); // 71, 61, 51, 41, 31, 21, 11, 01
-      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 32)); // 72, 62, 52, 42, 32, 22, 12, 02
-      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 48)); // 73, 63, 53, 43, 33, 23, 13, 03
-      xmm4 = xmm0;
-      xmm6 = xmm2;
-      xmm0 = _mm_unpacklo_epi16(xmm0, xmm1); // 31, 30, 21, 20, 11, 10, 01, 00
-      xmm4 = _mm_unpackhi_epi16(xmm4, xmm1); // 71, 70, 61, 60, 51, 50, 41, 40
-      xmm2 = _mm_unpacklo_epi16(xmm2, xmm3); // 33, 32, 23, 22, 13, 12, 03, 02
-      xmm6 = _mm_unpackhi_epi16(xmm6, xmm3); // 73, 72, 63, 62, 53, 52, 43, 42
-      xmm1 = xmm0;
-      xmm5 = xmm4;
-      xmm0 = _mm_unpacklo_epi32(xmm0, xmm2);  // 13, 12, 11, 10, 03, 02, 01, 00
-      xmm1 = _mm_unpackhi_epi32(xmm1, xmm2); // 33, 32, 31, 30, 23, 22, 21, 20
-      xmm4 = _mm_unpacklo_epi32(xmm4, xmm6); // 53, 52, 51, 50, 43, 42, 41, 40
-      xmm5 = _mm_unpackhi_epi32(xmm5, xmm6); // 73, 72, 71, 70, 63, 62, 61, 60
-      _mm_storel_epi64(reinterpret_cast<__m128i*>(edi), xmm0);
-      _mm_storel_epi64(reinterpret_cast<__m128i*>(edi + 2 * eax), xmm1);
-      _mm_storel_epi64(reinterpret_cast<__m128i*>(edx), xmm4);
-      _mm_storel_epi64(reinterpret_cast<__m128i*>(edx + 2 * eax), xmm5);
-      xmm0 = _mm_unpackhi_epi64(xmm0, xmm0);
-      xmm1 = _mm_unpackhi_epi64(xmm1, xmm1);
-      xmm4 = _mm_unpackhi_epi64(xmm4, xmm4);
-      xmm5 = _mm_unpackhi_epi64(xmm5, xmm5);
-      _mm_storel_epi64(reinterpret_cast<__m128i*>(edi + eax), xmm0);
-      _mm_storel_epi64(reinterpret_cast<__m128i*>(edi + 3 * eax), xmm1);
-      _mm_storel_epi64(reinterpret_cast<__m128i*>(edx + eax), xmm4);
-      _mm_storel_epi64(reinterpret_cast<__m128i*>(edx + 3 * eax), xmm5);
-      esi += 64;
-      edi += 8;
-      edx += 8;
-    }
+  short* srcp1 = buf[thread_id].bufx[0] + 8;
+  short* srcp2 = buf[thread_id].bufx[1] + 8;
+  short* dstp = ring + (y & 8) * pitch + 8;
+
+  // wavelet transform
+  uint8_t* esi = (uint8_t*)srcp1;
+  uint8_t* edx = (uint8_t*)srcp2;
+  uint8_t* edi = (uint8_t*)work;
+
+  xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx - 16));
+  xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi));
+  xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx));
+  xmm2 = _mm_add_epi16(xmm2, xmm1);
+  xmm2 = _mm_srai_epi16(xmm2, 2);
+  xmm0 = _mm_sub_epi16(xmm0, xmm2);
+  _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm0);
+
+  //wavelet_next4columns:
+  for (int horiz = 0; horiz < hloop1; horiz++) {
+    xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 16));
+    xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx + 16));
+    xmm4 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 32));
+    xmm5 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx + 32));
+    xmm6 = xmm1;
+    xmm7 = xmm3;
+    xmm1 = _mm_add_epi16(xmm1, xmm3);
+    xmm3 = _mm_add_epi16(xmm3, xmm5);
+    xmm1 = _mm_srai_epi16(xmm1, 2);
+    xmm3 = _mm_srai_epi16(xmm3, 2);
+    xmm2 = _mm_sub_epi16(xmm2, xmm1);
+    xmm4 = _mm_sub_epi16(xmm4, xmm3);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + 32), xmm2);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + 64), xmm4);
+    xmm0 = _mm_add_epi16(xmm0, xmm2);
+    xmm2 = _mm_add_epi16(xmm2, xmm4);
+    xmm0 = _mm_srai_epi16(xmm0, 1);
+    xmm2 = _mm_srai_epi16(xmm2, 1);
+    xmm6 = _mm_add_epi16(xmm6, xmm0);
+    xmm7 = _mm_add_epi16(xmm7, xmm2);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + 16), xmm6);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + 48), xmm7);
+    xmm0 = xmm4;
+    xmm1 = xmm5;
+    esi += 32;
+    edx += 32;
+    edi += 64;
   }
 
-  // vertical reflection
-  if (thread_id == threads - 1 && height % 2 == 0)
-    memcpy(bufy[0] + height / 2 * pitch, bufy[0] + (height / 2 - 1) * pitch, pitch * sizeof(short));
+  // shuffle
+  esi = (uint8_t*)work;
+  edi = (uint8_t*)dstp;
+  const int eax = pitch * sizeof(short); // eax = pitch * sizeof(short)
+  edx = edi + 4 * eax; // edx = dstp + 4 * pitch
+
+  // shuffle_next4columns:
+  for (int horiz = 0; horiz < hloop1; horiz++) {
+    xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi)); // 70, 60, 50, 40, 30, 20, 10, 00
+    xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 16)); // 71, 61, 51, 41, 31, 21, 11, 01
+    xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 32)); // 72, 62, 52, 42, 32, 22, 12, 02
+    xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 48)); // 73, 63, 53, 43, 33, 23, 13, 03
+    xmm4 = xmm0;
+    xmm6 = xmm2;
+    xmm0 = _mm_unpacklo_epi16(xmm0, xmm1); // 31, 30, 21, 20, 11, 10, 01, 00
+    xmm4 = _mm_unpackhi_epi16(xmm4, xmm1); // 71, 70, 61, 60, 51, 50, 41, 40
+    xmm2 = _mm_unpacklo_epi16(xmm2, xmm3); // 33, 32, 23, 22, 13, 12, 03, 02
+    xmm6 = _mm_unpackhi_epi16(xmm6, xmm3); // 73, 72, 63, 62, 53, 52, 43, 42
+    xmm1 = xmm0;
+    xmm5 = xmm4;
+    xmm0 = _mm_unpacklo_epi32(xmm0, xmm2);  // 13, 12, 11, 10, 03, 02, 01, 00
+    xmm1 = _mm_unpackhi_epi32(xmm1, xmm2); // 33, 32, 31, 30, 23, 22, 21, 20
+    xmm4 = _mm_unpacklo_epi32(xmm4, xmm6); // 53, 52, 51, 50, 43, 42, 41, 40
+    xmm5 = _mm_unpackhi_epi32(xmm5, xmm6); // 73, 72, 71, 70, 63, 62, 61, 60
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edi), xmm0);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edi + 2 * eax), xmm1);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edx), xmm4);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edx + 2 * eax), xmm5);
+    xmm0 = _mm_unpackhi_epi64(xmm0, xmm0);
+    xmm1 = _mm_unpackhi_epi64(xmm1, xmm1);
+    xmm4 = _mm_unpackhi_epi64(xmm4, xmm4);
+    xmm5 = _mm_unpackhi_epi64(xmm5, xmm5);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edi + eax), xmm0);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edi + 3 * eax), xmm1);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edx + eax), xmm4);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edx + 3 * eax), xmm5);
+    esi += 64;
+    edi += 8;
+    edx += 8;
+  }
 }
 
-void MosquitoNR::InvWaveletVert(int thread_id)
+// vertical inverse transform of a block, the first row of the next block must be in the ring buffer
+void MosquitoNR::InvWaveletVert(int thread_id, int y)
 {
-  const int y_start = (height + 7) / 8 * thread_id / threads * 8;
-  const int y_end = (height + 7) / 8 * (thread_id + 1) / threads * 8;
-  if (y_start == y_end) return;
+  const int width = buf[thread_id].width;
   const int pitch = this->pitch;
+  const int height = buf[thread_id].height;
+  const int vloop = ((height + 7) & ~7) / 2; // rows of vertical approximation coefficients
+  const int hloop2 = (width + 7) / 8;
+  short* work = buf[thread_id].work;
+  short* ring = work + 16 * pitch; // 2 blocks of vertical approximation coefficients
 
   __m128i xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7;
 
-  for (int y = y_start; y < y_end; y += 8)
+  for (int r = y; r < y + 8 && r < vloop; r += 4)
   {
-    int hloop = (width + 7) / 8;
-    short* srcp1 = bufy[0] + y / 2 * pitch + 8;
-    short* srcp2 = bufy[1] + y / 2 * pitch + 8;
-    short* dstp = luma[1] + (y + 2) * pitch + 8;
+    short* srcp1[5]; // approximation rows 0 to 4, reflected at the bottom edge
+    short* srcp2[6]; // detail rows -1 to 4 (odd rows of luma[1]), reflected at the top and bottom edges
+    short* dstp = LumaRow(thread_id, 0, r * 2);
+    for (int i = 0; i < 5; ++i)
+      srcp1[i] = ring + (ReflectRow(thread_id, (r + i) * 2) / 2 & 15) * pitch + 8;
+    for (int i = 0; i < 6; ++i)
+      srcp2[i] = LumaRow(thread_id, 1, ReflectRow(thread_id, (r + i) * 2 - 1));
 
-    uint8_t* esi = (uint8_t*)srcp1;
-    uint8_t* edx = (uint8_t*)srcp2;
     uint8_t* edi = (uint8_t*)dstp;
-
     const int eax = pitch * sizeof(short);
-    const int ecx = eax * 5; // ecx = pitch * sizeof(short) * 5
 
     // next8columns:
-    for (int horiz = 0; horiz < hloop; horiz++) {
+    for (int horiz = 0, x = 0; horiz < hloop2; horiz++, x += 8) {
       auto tmp_edi = edi; //  push edi
-      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx));
-      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi));
-      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx + eax));
+      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp2[0] + x));
+      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp1[0] + x));
+      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp2[1] + x));
       xmm2 = _mm_add_epi16(xmm2, xmm1);
       xmm2 = _mm_srai_epi16(xmm2, 2);
       xmm0 = _mm_sub_epi16(xmm0, xmm2);
       _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm0);
 
-      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 1 * eax));
-      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx + 2 * eax));
-      xmm4 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 2 * eax));
-      xmm5 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx + 3 * eax));
+      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp1[1] + x));
+      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp2[2] + x));
+      xmm4 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp1[2] + x));
+      xmm5 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp2[3] + x));
       xmm6 = xmm1;
       xmm7 = xmm3;
       xmm1 = _mm_add_epi16(xmm1, xmm3);
@@ -762,10 +729,10 @@ void MosquitoNR::InvWaveletVert(int thread_id)
 
       edi += 4 * eax;
 
-      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 3 * eax));
-      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx + 4 * eax));
-      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 4 * eax));
-      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(edx + ecx));
+      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp1[3] + x));
+      xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp2[4] + x));
+      xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp1[4] + x));
+      xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp2[5] + x));
       xmm6 = xmm5;
       xmm7 = xmm1;
       xmm5 = _mm_add_epi16(xmm5, xmm1);
@@ -785,8 +752,129 @@ void MosquitoNR::InvWaveletVert(int thread_id)
       _mm_store_si128(reinterpret_cast<__m128i*>(edi + 3 * eax), xmm7);
 
       edi = tmp_edi;
-      esi += 16;
-      edx += 16;
+      edi += 16;
+    }
+  }
+}
+
+// inverse transform of bufx[0] with zero detail coefficients, added to luma[1]
+// horizontal step of a block into the ring buffer of vertical approximation coefficients
+void MosquitoNR::InvApproxHorz(int thread_id, int y)
+{
+  const int width = buf[thread_id].width;
+  const int pitch = this->pitch;
+  const int hloop1 = (width + 3) / 4;
+  short* work = buf[thread_id].work;
+  short* ring = work + 16 * pitch; // 2 blocks of vertical approximation coefficients
+
+  __m128i xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6;
+
+  short* srcp = buf[thread_id].bufx[0] + 8;
+  short* dstp = ring + (y & 8) * pitch + 8;
+
+  // interpolation
+  uint8_t* esi = (uint8_t*)srcp;
+  uint8_t* edi = (uint8_t*)work;
+
+  xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi));
+  _mm_store_si128(reinterpret_cast<__m128i*>(edi), xmm0);
+
+  for (int horiz = 0; horiz < hloop1; horiz++) {
+    xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 16));
+    xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 32));
+    xmm3 = _mm_add_epi16(xmm0, xmm1);
+    xmm4 = _mm_add_epi16(xmm1, xmm2);
+    xmm3 = _mm_srai_epi16(xmm3, 1);
+    xmm4 = _mm_srai_epi16(xmm4, 1);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + 16), xmm3);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + 32), xmm1);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + 48), xmm4);
+    _mm_store_si128(reinterpret_cast<__m128i*>(edi + 64), xmm2);
+    xmm0 = xmm2;
+    esi += 32;
+    edi += 64;
+  }
+
+  // shuffle
+  esi = (uint8_t*)work;
+  edi = (uint8_t*)dstp;
+  const int eax = pitch * sizeof(short); // eax = pitch * sizeof(short)
+  uint8_t* edx = edi + 4 * eax; // edx = dstp + 4 * pitch
+
+  for (int horiz = 0; horiz < hloop1; horiz++) {
+    xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi)); // 70, 60, 50, 40, 30, 20, 10, 00
+    xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 16)); // 71, 61, 51, 41, 31, 21, 11, 01
+    xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 32)); // 72, 62, 52, 42, 32, 22, 12, 02
+    xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(esi + 48)); // 73, 63, 53, 43, 33, 23, 13, 03
+    xmm4 = xmm0;
+    xmm6 = xmm2;
+    xmm0 = _mm_unpacklo_epi16(xmm0, xmm1); // 31, 30, 21, 20, 11, 10, 01, 00
+    xmm4 = _mm_unpackhi_epi16(xmm4, xmm1); // 71, 70, 61, 60, 51, 50, 41, 40
+    xmm2 = _mm_unpacklo_epi16(xmm2, xmm3); // 33, 32, 23, 22, 13, 12, 03, 02
+    xmm6 = _mm_unpackhi_epi16(xmm6, xmm3); // 73, 72, 63, 62, 53, 52, 43, 42
+    xmm1 = xmm0;
+    xmm5 = xmm4;
+    xmm0 = _mm_unpacklo_epi32(xmm0, xmm2); // 13, 12, 11, 10, 03, 02, 01, 00
+    xmm1 = _mm_unpackhi_epi32(xmm1, xmm2); // 33, 32, 31, 30, 23, 22, 21, 20
+    xmm4 = _mm_unpacklo_epi32(xmm4, xmm6); // 53, 52, 51, 50, 43, 42, 41, 40
+    xmm5 = _mm_unpackhi_epi32(xmm5, xmm6); // 73, 72, 71, 70, 63, 62, 61, 60
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edi), xmm0);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edi + 2 * eax), xmm1);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edx), xmm4);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edx + 2 * eax), xmm5);
+    xmm0 = _mm_unpackhi_epi64(xmm0, xmm0);
+    xmm1 = _mm_unpackhi_epi64(xmm1, xmm1);
+    xmm4 = _mm_unpackhi_epi64(xmm4, xmm4);
+    xmm5 = _mm_unpackhi_epi64(xmm5, xmm5);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edi + eax), xmm0);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edi + 3 * eax), xmm1);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edx + eax), xmm4);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(edx + 3 * eax), xmm5);
+    esi += 64;
+    edi += 8;
+    edx += 8;
+  }
+}
+
+// vertical step of a block, the first row of the next block must be in the ring buffer
+void MosquitoNR::InvApproxVert(int thread_id, int y)
+{
+  const int width = buf[thread_id].width;
+  const int pitch = this->pitch;
+  const int height = buf[thread_id].height;
+  const int vloop = ((height + 7) & ~7) / 2; // rows of vertical approximation coefficients
+  const int hloop2 = (width + 7) / 8;
+  short* work = buf[thread_id].work;
+  short* ring = work + 16 * pitch; // 2 blocks of vertical approximation coefficients
+
+  __m128i xmm0, xmm1, xmm2, xmm3;
+
+  for (int r = y; r < y + 8 && r < vloop; r += 4)
+  {
+    short* srcp[5]; // approximation rows 0 to 4, reflected at the bottom edge
+    short* dstp = LumaRow(thread_id, 1, r * 2);
+    for (int i = 0; i < 5; ++i)
+      srcp[i] = ring + (ReflectRow(thread_id, (r + i) * 2) / 2 & 15) * pitch + 8;
+
+    uint8_t* edi = (uint8_t*)dstp;
+    const int eax = pitch * sizeof(short);
+
+    for (int horiz = 0, x = 0; horiz < hloop2; horiz++, x += 8) {
+      uint8_t* dst = edi;
+      xmm0 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[0] + x));
+      for (int i = 0; i < 4; i++) {
+        xmm1 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp[i + 1] + x));
+        xmm2 = _mm_load_si128(reinterpret_cast<const __m128i*>(dst));
+        xmm3 = _mm_load_si128(reinterpret_cast<const __m128i*>(dst + eax));
+        xmm2 = _mm_add_epi16(xmm2, xmm0);
+        xmm0 = _mm_add_epi16(xmm0, xmm1);
+        xmm0 = _mm_srai_epi16(xmm0, 1);
+        xmm3 = _mm_add_epi16(xmm3, xmm0);
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst), xmm2);
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst + eax), xmm3);
+        xmm0 = xmm1;
+        dst += 2 * eax;
+      }
       edi += 16;
     }
   }